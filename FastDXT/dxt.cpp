@@ -22,6 +22,7 @@ void GetMinMaxColorsAlpha(  byte *colorBlock, byte *minColor, byte *maxColor );
 
 
 word ColorTo565( const byte *color );
+int ColorDistance( const byte *c1, const byte *c2 );
 
 void EmitByte( byte b, byte*& );
 void EmitWord( word s, byte*& );
@@ -36,39 +37,184 @@ void EmitAlphaIndices( const byte *colorBlock, const byte minAlpha, const byte m
 void EmitAlphaIndicesFast( const byte *colorBlock, const byte minAlpha, const byte maxAlpha, byte *&outData);
 void EmitAlphaIndices_Intrinsics( const byte *colorBlock, const byte minAlpha, const byte maxAlpha, byte *&outData);
 
+// Several blocks at a time, in intrinsic_avx2.cpp and intrinsic_avx512.cpp
+void CompressBlocksDXT1_AVX2( const byte *inPtr, int width, byte *&outData );
+void CompressBlocksDXT1_AVX512( const byte *inPtr, int width, byte *&outData );
 
-void CompressImageDXT1( const byte *inBuf, byte *outBuf,
-			int width, int height, int &outputBytes )
+
+static void CompressBlockDXT1( const byte *inPtr, int width, byte *&outData )
 {
-  ALIGN16( byte *outData );
   ALIGN16( byte block[64] );
   ALIGN16( byte minColor[16] );	// Originally 4 bytes, but _mm_store_si128 needs them to be at least 16 to not oveflow.
   ALIGN16( byte maxColor[16] );
 
-  outData = outBuf;
-  for ( int j = 0; j < height; j += 4, inBuf += width * 4*4 ) {
-    for ( int i = 0; i < width; i += 4 ) {
+#if defined(DXT_INTR)
+  ExtractBlock_Intrinsics( inPtr, width, block );
+#else
+  ExtractBlock( inPtr, width, block );
+#endif
 
 #if defined(DXT_INTR)
-	ExtractBlock_Intrinsics( inBuf + i * 4, width, block );
+  GetMinMaxColors_Intrinsics( block, minColor, maxColor );
 #else
-	ExtractBlock( inBuf + i * 4, width, block );
+  GetMinMaxColorsByBBox( block, minColor, maxColor );
 #endif
 
+  EmitWord( ColorTo565( maxColor ), outData );
+  EmitWord( ColorTo565( minColor ), outData );
+
 #if defined(DXT_INTR)
-      GetMinMaxColors_Intrinsics( block, minColor, maxColor );
+  EmitColorIndices_Intrinsics( block, minColor, maxColor, outData );
 #else
-      GetMinMaxColorsByBBox( block, minColor, maxColor );
+  EmitColorIndicesFast( block, minColor, maxColor, outData );
 #endif
+}
 
-      EmitWord( ColorTo565( maxColor ), outData );
-      EmitWord( ColorTo565( minColor ), outData );
 
+// Each entry encodes the given number of neighbouring blocks per call.
+typedef struct {
+  const char *name;
+  int blocks;
+  void (*dxt1)( const byte *inPtr, int width, byte *&outData );
+} dxtkernel_t;
+
+static const dxtkernel_t dxtkernels[] = {
+  { "auto",    1, CompressBlockDXT1 },
 #if defined(DXT_INTR)
-      EmitColorIndices_Intrinsics( block, minColor, maxColor, outData );
+  { "sse2",    1, CompressBlockDXT1 },
 #else
-      EmitColorIndicesFast( block, minColor, maxColor, outData );
+  { "scalar",  1, CompressBlockDXT1 },
+#endif
+#if defined(DXT_AVX)
+  { "avx2",    2, CompressBlocksDXT1_AVX2 },
+  { "avx512",  4, CompressBlocksDXT1_AVX512 },
+#endif
+};
+
+static int dxtsimd = DXTSetSIMD( DXT_SIMD_AUTO );
+
+int DXTSetSIMD( int simd )
+{
+  int best = DXT_SIMD_SSE2;
+#if defined(DXT_AVX)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ) best = DXT_SIMD_AVX2;
+  if ( best == DXT_SIMD_AVX2 && __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512bw" ) ) best = DXT_SIMD_AVX512;
+#endif
+  if ( simd <= DXT_SIMD_AUTO || simd > best ) simd = best;
+  dxtsimd = simd;
+  return simd;
+}
+
+int DXTGetSIMD()
+{
+  return dxtsimd;
+}
+
+const char *DXTSIMDName( int simd )
+{
+  if ( simd < 0 || simd >= (int)( sizeof(dxtkernels) / sizeof(dxtkernels[0]) ) ) return "unknown";
+  return dxtkernels[simd].name;
+}
+
+
+void CompressImageDXT1( const byte *inBuf, byte *outBuf,
+			int width, int height, int &outputBytes )
+{
+  ALIGN16( byte *outData );
+  const dxtkernel_t *kernel = &dxtkernels[dxtsimd];
+  int wide = kernel->blocks * 4;
+
+  outData = outBuf;
+  for ( int j = 0; j < height; j += 4, inBuf += width * 4*4 ) {
+    int i = 0;
+    for ( ; i + wide <= width; i += wide ) {
+      kernel->dxt1( inBuf + i * 4, width, outData );
+    }
+    for ( ; i < width; i += 4 ) {
+      CompressBlockDXT1( inBuf + i * 4, width, outData );
+    }
+  }
+  outputBytes = (int) ( outData - outBuf );
+}
+
+// A block with transparent pixels, in the 3 colour mode where index 3 is transparent black.
+// The decoder picks that mode when the first colour isn't greater than the second.
+static void CompressBlockDXT1a( const byte *colorBlock, byte *&outData )
+{
+  byte minColor[4] = { 255, 255, 255, 0 };
+  byte maxColor[4] = { 0, 0, 0, 0 };
+  byte colors[3][4];
+  int opaque = 0;
+
+  for ( int i = 0; i < 16; i++ ) {
+    const byte *c = colorBlock + i * 4;
+    if ( c[3] < 128 ) continue;
+    for ( int k = 0; k < 3; k++ ) {
+      if ( c[k] < minColor[k] ) minColor[k] = c[k];
+      if ( c[k] > maxColor[k] ) maxColor[k] = c[k];
+    }
+    opaque++;
+  }
+  if ( !opaque ) {
+    EmitWord( 0, outData );
+    EmitWord( 0, outData );
+    EmitDoubleWord( 0xFFFFFFFF, outData );
+    return;
+  }
+  for ( int k = 0; k < 3; k++ ) {
+    int inset = ( maxColor[k] - minColor[k] ) >> INSET_SHIFT;
+    minColor[k] += inset;
+    maxColor[k] -= inset;
+  }
+
+  // min <= max in every channel, so the 565 values come out in the right order.
+  EmitWord( ColorTo565( minColor ), outData );
+  EmitWord( ColorTo565( maxColor ), outData );
+
+  colors[0][0] = ( minColor[0] & C565_5_MASK ) | ( minColor[0] >> 5 );
+  colors[0][1] = ( minColor[1] & C565_6_MASK ) | ( minColor[1] >> 6 );
+  colors[0][2] = ( minColor[2] & C565_5_MASK ) | ( minColor[2] >> 5 );
+  colors[1][0] = ( maxColor[0] & C565_5_MASK ) | ( maxColor[0] >> 5 );
+  colors[1][1] = ( maxColor[1] & C565_6_MASK ) | ( maxColor[1] >> 6 );
+  colors[1][2] = ( maxColor[2] & C565_5_MASK ) | ( maxColor[2] >> 5 );
+  for ( int k = 0; k < 3; k++ ) colors[2][k] = ( colors[0][k] + colors[1][k] ) / 2;
+
+  dword result = 0;
+  for ( int i = 0; i < 16; i++ ) {
+    const byte *c = colorBlock + i * 4;
+    dword index = 3;
+    if ( c[3] >= 128 ) {
+      int best = MAX_INT;
+      for ( int j = 0; j < 3; j++ ) {
+        int dist = ColorDistance( c, colors[j] );
+        if ( dist < best ) { best = dist; index = j; }
+      }
+    }
+    result |= index << ( i << 1 );
+  }
+  EmitDoubleWord( result, outData );
+}
+
+void CompressImageDXT1a( const byte *inBuf, byte *outBuf,
+			int width, int height, int &outputBytes )
+{
+  ALIGN16( byte *outData );
+  ALIGN16( byte block[64] );
+
+  outData = outBuf;
+  for ( int j = 0; j < height; j += 4, inBuf += width * 4*4 ) {
+    for ( int i = 0; i < width; i += 4 ) {
+#if defined(DXT_INTR)
+      ExtractBlock_Intrinsics( inBuf + i * 4, width, block );
+#else
+      ExtractBlock( inBuf + i * 4, width, block );
 #endif
+      int transparent = 0;
+      for ( int k = 3; k < 64; k += 4 ) transparent |= ( block[k] < 128 );
+
+      if ( transparent ) CompressBlockDXT1a( block, outData );
+      else CompressBlockDXT1( inBuf + i * 4, width, outData );
     }
   }
   outputBytes = (int) ( outData - outBuf );
@@ -126,8 +272,8 @@ void CompressImageDXT5( const byte *inBuf, byte *outBuf, int width, int height,
   ALIGN16( byte *outData );
   
   ALIGN16( byte block[64] );
-  ALIGN16( byte minColor[4] );
-  ALIGN16( byte maxColor[4] );
+  ALIGN16( byte minColor[16] );	// GetMinMaxColors_Intrinsics stores 16 bytes, same as in CompressImageDXT1.
+  ALIGN16( byte maxColor[16] );
   
   outData = outBuf;
   for ( int j = 0; j < height; j += 4, inBuf += width * 4*4 ) {
@@ -149,10 +295,7 @@ void CompressImageDXT5( const byte *inBuf, byte *outBuf, int width, int height,
       EmitByte( minColor[3], outData);
       
 #if defined(DXT_INTR)
-	  // Not Yet Implemented
-      //EmitAlphaIndices_Intrinsics( block, minColor[3], maxColor[3], outData );
-
-      EmitAlphaIndicesFast( block, minColor[3], maxColor[3], outData );
+      EmitAlphaIndices_Intrinsics( block, minColor[3], maxColor[3], outData );
 #else
       EmitAlphaIndicesFast( block, minColor[3], maxColor[3], outData );
 #endif
@@ -50,19 +50,44 @@ typedef unsigned int dword;
 
 #if defined(__GNUC__)
 #define   ALIGN16(_x)   _x __attribute((aligned(16)))
+#define   ALIGN32(_x)   _x __attribute((aligned(32)))
+#define   ALIGN64(_x)   _x __attribute((aligned(64)))
 #else
 #define   ALIGN16( x ) __declspec(align(16)) x
+#define   ALIGN32( x ) __declspec(align(32)) x
+#define   ALIGN64( x ) __declspec(align(64)) x
 #endif
 
+// The AVX2 and AVX-512 encoders are built with per-function target
+// attributes and only used when the CPU running us has them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DXT_AVX 1
+#endif
+
+#define DXT_SIMD_AUTO    0
+#define DXT_SIMD_SSE2    1
+#define DXT_SIMD_AVX2    2
+#define DXT_SIMD_AVX512  3
+
 
 // Compress to DXT1 format
 void CompressImageDXT1( const byte *inBuf, byte *outBuf, int width, int height, int &outputBytes );
 
+// Compress to DXT1 format, with pixels of alpha below 128 made transparent
+void CompressImageDXT1a( const byte *inBuf, byte *outBuf, int width, int height, int &outputBytes );
+
 // Compress to DXT5 format
 void CompressImageDXT5( const byte *inBuf, byte *outBuf, int width, int height, int &outputBytes );
 
 // Compress to DXT5 format, first convert to YCoCg color space
 void CompressImageDXT5YCoCg( const byte *inBuf, byte *outBuf, int width, int height, int &outputBytes );
 
+// Pick the encoder for the given DXT_SIMD_* level, or the best the CPU
+// supports for DXT_SIMD_AUTO. Levels the CPU lacks fall back to the next
+// lower one. Returns the level in use.
+int DXTSetSIMD( int simd );
+int DXTGetSIMD();
+const char *DXTSIMDName( int simd );
+
 // Compute error between two images
 double ComputeError( const byte *original, const byte *dxt, int width, int height);
@@ -397,137 +397,113 @@ ALIGN16( static dword SIMD_SSE2_dword_alpha_bit_mask7[4] ) = { 7<<21, 0, 7<<21,
 
 void EmitAlphaIndices_Intrinsics( const byte *colorBlock, const byte minAlpha, const byte maxAlpha, byte *&outData)
 {
-/*
-  __asm {
-    mov esi, colorBlock
-      movdqa xmm0, [esi+ 0]
-      movdqa xmm5, [esi+16]
-      psrld xmm0, 24
-      psrld xmm5, 24
-      packuswb xmm0, xmm5
-
-      movdqa xmm6, [esi+32]
-      movdqa xmm4, [esi+48]
-      psrld xmm6, 24
-      psrld xmm4, 24
-      packuswb xmm6, xmm4
-
-      movzx ecx, maxAlpha
-      movd xmm5, ecx
-      pshuflw xmm5, xmm5, R_SHUFFLE_D( 0, 0, 0, 0 )
-      pshufd xmm5, xmm5, R_SHUFFLE_D( 0, 0, 0, 0 )
-      movdqa xmm7, xmm5
-
-      movzx edx, minAlpha
-      movd xmm2, edx
-      pshuflw xmm2, xmm2, R_SHUFFLE_D( 0, 0, 0, 0 )
-      pshufd xmm2, xmm2, R_SHUFFLE_D( 0, 0, 0, 0 )
-      movdqa xmm3, xmm2
-
-      movdqa xmm4, xmm5
-      psubw xmm4, xmm2
-      pmulhw xmm4, SIMD_SSE2_word_div_by_14    // * ( ( 1 << 16 ) / 14 + 1 ) ) >> 16
-      movdqa xmm1, xmm2
-      paddw xmm1, xmm4
-      packuswb xmm1, xmm1                      // ab1
-
-      pmullw xmm5, SIMD_SSE2_word_scale66554400
-      pmullw xmm7, SIMD_SSE2_word_scale11223300
-      pmullw xmm2, SIMD_SSE2_word_scale11223300
-      pmullw xmm3, SIMD_SSE2_word_scale66554400
-      paddw xmm5, xmm2
-      paddw xmm7, xmm3
-      pmulhw xmm5, SIMD_SSE2_word_div_by_7 // * ( ( 1 << 16 ) / 7 + 1 ) ) >> 16
-      pmulhw xmm7, SIMD_SSE2_word_div_by_7 // * ( ( 1 << 16 ) / 7 + 1 ) ) >> 16
-      paddw xmm5, xmm4
-      paddw xmm7, xmm4
-
-      pshufd xmm2, xmm5, R_SHUFFLE_D( 0, 0, 0, 0 )
-      pshufd xmm3, xmm5, R_SHUFFLE_D( 1, 1, 1, 1 )
-      pshufd xmm4, xmm5, R_SHUFFLE_D( 2, 2, 2, 2 )
-      packuswb xmm2, xmm2 // ab2
-      packuswb xmm3, xmm3 // ab3
-      packuswb xmm4, xmm4 // ab4
-
-      packuswb xmm0, xmm6 // alpha values
-
-      pshufd xmm5, xmm7, R_SHUFFLE_D( 2, 2, 2, 2 )
-      pshufd xmm6, xmm7, R_SHUFFLE_D( 1, 1, 1, 1 )
-      pshufd xmm7, xmm7, R_SHUFFLE_D( 0, 0, 0, 0 )
-      packuswb xmm5, xmm5 // ab5
-      packuswb xmm6, xmm6 // ab6
-      packuswb xmm7, xmm7 // ab7
-
-      pminub xmm1, xmm0
-      pminub xmm2, xmm0
-      pminub xmm3, xmm0
-      pcmpeqb xmm1, xmm0
-      pcmpeqb xmm2, xmm0
-      pcmpeqb xmm3, xmm0
-      pminub xmm4, xmm0
-      pminub xmm5, xmm0
-      pminub xmm6, xmm0
-      pminub xmm7, xmm0
-      pcmpeqb xmm4, xmm0
-      pcmpeqb xmm5, xmm0
-      pcmpeqb xmm6, xmm0
-      pcmpeqb xmm7, xmm0
-      pand xmm1, SIMD_SSE2_byte_1
-      pand xmm2, SIMD_SSE2_byte_1
-      pand xmm3, SIMD_SSE2_byte_1
-      pand xmm4, SIMD_SSE2_byte_1
-      pand xmm5, SIMD_SSE2_byte_1
-      pand xmm6, SIMD_SSE2_byte_1
-      pand xmm7, SIMD_SSE2_byte_1
-      movdqa xmm0, SIMD_SSE2_byte_1
-      paddusb xmm0, xmm1
-      paddusb xmm2, xmm3
-      paddusb xmm4, xmm5
-      paddusb xmm6, xmm7
-      paddusb xmm0, xmm2
-      paddusb xmm4, xmm6
-      paddusb xmm0, xmm4
-      pand xmm0, SIMD_SSE2_byte_7
-      movdqa xmm1, SIMD_SSE2_byte_2
-      pcmpgtb xmm1, xmm0
-      pand xmm1, SIMD_SSE2_byte_1
-      pxor xmm0, xmm1
-      movdqa xmm1, xmm0
-      movdqa xmm2, xmm0
-      movdqa xmm3, xmm0
-      movdqa xmm4, xmm0
-      movdqa xmm5, xmm0
-      movdqa xmm6, xmm0
-      movdqa xmm7, xmm0
-      psrlq xmm1, 8- 3
-      psrlq xmm2, 16- 6
-      psrlq xmm3, 24- 9
-
-      psrlq xmm4, 32-12
-      psrlq xmm5, 40-15
-      psrlq xmm6, 48-18
-      psrlq xmm7, 56-21
-      pand xmm0, SIMD_SSE2_dword_alpha_bit_mask0
-      pand xmm1, SIMD_SSE2_dword_alpha_bit_mask1
-      pand xmm2, SIMD_SSE2_dword_alpha_bit_mask2
-      pand xmm3, SIMD_SSE2_dword_alpha_bit_mask3
-      pand xmm4, SIMD_SSE2_dword_alpha_bit_mask4
-      pand xmm5, SIMD_SSE2_dword_alpha_bit_mask5
-      pand xmm6, SIMD_SSE2_dword_alpha_bit_mask6
-      pand xmm7, SIMD_SSE2_dword_alpha_bit_mask7
-      por xmm0, xmm1
-      por xmm2, xmm3
-      por xmm4, xmm5
-      por xmm6, xmm7
-      por xmm0, xmm2
-      por xmm4, xmm6
-      por xmm0, xmm4
-      mov esi, outData
-      movd [esi+0], xmm0
-      pshufd xmm1, xmm0, R_SHUFFLE_D( 2, 3, 0, 1 )
-      movd [esi+3], xmm1
-      }
-  outData += 6;
-*/
+	__m128i t0, t1, t2, t3, t4, t5, t6, t7;
+
+	// alpha values of the 16 pixels, in order
+	t0 = _mm_load_si128 ( (__m128i*) (colorBlock+ 0) );
+	t5 = _mm_load_si128 ( (__m128i*) (colorBlock+16) );
+	t0 = _mm_srli_epi32( t0, 24 );
+	t5 = _mm_srli_epi32( t5, 24 );
+	t0 = _mm_packus_epi16( t0, t5 );
+
+	t6 = _mm_load_si128 ( (__m128i*) (colorBlock+32) );
+	t4 = _mm_load_si128 ( (__m128i*) (colorBlock+48) );
+	t6 = _mm_srli_epi32( t6, 24 );
+	t4 = _mm_srli_epi32( t4, 24 );
+	t6 = _mm_packus_epi16( t6, t4 );
+
+	t5 = _mm_set1_epi16( maxAlpha );
+	t7 = t5;
+	t2 = _mm_set1_epi16( minAlpha );
+	t3 = t2;
+
+	// thresholds half way between the 8 alpha values
+	t4 = _mm_sub_epi16( t5, t2 );
+	t4 = _mm_mulhi_epi16( t4, _mm_load_si128 ( (__m128i*) SIMD_SSE2_word_div_by_14 ) );
+	t1 = _mm_add_epi16( t2, t4 );
+	t1 = _mm_packus_epi16( t1, t1 );                      // ab1
+
+	t5 = _mm_mullo_epi16( t5, _mm_load_si128 ( (__m128i*) SIMD_SSE2_word_scale66554400 ) );
+	t7 = _mm_mullo_epi16( t7, _mm_load_si128 ( (__m128i*) SIMD_SSE2_word_scale11223300 ) );
+	t2 = _mm_mullo_epi16( t2, _mm_load_si128 ( (__m128i*) SIMD_SSE2_word_scale11223300 ) );
+	t3 = _mm_mullo_epi16( t3, _mm_load_si128 ( (__m128i*) SIMD_SSE2_word_scale66554400 ) );
+	t5 = _mm_add_epi16( t5, t2 );
+	t7 = _mm_add_epi16( t7, t3 );
+	t5 = _mm_mulhi_epi16( t5, _mm_load_si128 ( (__m128i*) SIMD_SSE2_word_div_by_7 ) );
+	t7 = _mm_mulhi_epi16( t7, _mm_load_si128 ( (__m128i*) SIMD_SSE2_word_div_by_7 ) );
+	t5 = _mm_add_epi16( t5, t4 );
+	t7 = _mm_add_epi16( t7, t4 );
+
+	t2 = _mm_shuffle_epi32( t5, R_SHUFFLE_D( 0, 0, 0, 0 ) );
+	t3 = _mm_shuffle_epi32( t5, R_SHUFFLE_D( 1, 1, 1, 1 ) );
+	t4 = _mm_shuffle_epi32( t5, R_SHUFFLE_D( 2, 2, 2, 2 ) );
+	t2 = _mm_packus_epi16( t2, t2 );                      // ab2
+	t3 = _mm_packus_epi16( t3, t3 );                      // ab3
+	t4 = _mm_packus_epi16( t4, t4 );                      // ab4
+
+	t0 = _mm_packus_epi16( t0, t6 );                      // alpha values
+
+	t5 = _mm_shuffle_epi32( t7, R_SHUFFLE_D( 2, 2, 2, 2 ) );
+	t6 = _mm_shuffle_epi32( t7, R_SHUFFLE_D( 1, 1, 1, 1 ) );
+	t7 = _mm_shuffle_epi32( t7, R_SHUFFLE_D( 0, 0, 0, 0 ) );
+	t5 = _mm_packus_epi16( t5, t5 );                      // ab5
+	t6 = _mm_packus_epi16( t6, t6 );                      // ab6
+	t7 = _mm_packus_epi16( t7, t7 );                      // ab7
+
+	// count the thresholds each alpha is at or below
+	__m128i b1 = _mm_load_si128 ( (__m128i*) SIMD_SSE2_byte_1 );
+	t1 = _mm_and_si128( _mm_cmpeq_epi8( _mm_min_epu8( t1, t0 ), t0 ), b1 );
+	t2 = _mm_and_si128( _mm_cmpeq_epi8( _mm_min_epu8( t2, t0 ), t0 ), b1 );
+	t3 = _mm_and_si128( _mm_cmpeq_epi8( _mm_min_epu8( t3, t0 ), t0 ), b1 );
+	t4 = _mm_and_si128( _mm_cmpeq_epi8( _mm_min_epu8( t4, t0 ), t0 ), b1 );
+	t5 = _mm_and_si128( _mm_cmpeq_epi8( _mm_min_epu8( t5, t0 ), t0 ), b1 );
+	t6 = _mm_and_si128( _mm_cmpeq_epi8( _mm_min_epu8( t6, t0 ), t0 ), b1 );
+	t7 = _mm_and_si128( _mm_cmpeq_epi8( _mm_min_epu8( t7, t0 ), t0 ), b1 );
+
+	t0 = _mm_adds_epu8( b1, t1 );
+	t2 = _mm_adds_epu8( t2, t3 );
+	t4 = _mm_adds_epu8( t4, t5 );
+	t6 = _mm_adds_epu8( t6, t7 );
+	t0 = _mm_adds_epu8( t0, t2 );
+	t4 = _mm_adds_epu8( t4, t6 );
+	t0 = _mm_adds_epu8( t0, t4 );
+	t0 = _mm_and_si128( t0, _mm_load_si128 ( (__m128i*) SIMD_SSE2_byte_7 ) );
+
+	// swap indices 0 and 1 to the DXT5 order
+	t1 = _mm_cmpgt_epi8( _mm_load_si128 ( (__m128i*) SIMD_SSE2_byte_2 ), t0 );
+	t1 = _mm_and_si128( t1, b1 );
+	t0 = _mm_xor_si128( t0, t1 );
+
+	// pack the 3-bit indices, 8 per qword
+	t1 = _mm_srli_epi64( t0,  8- 3 );
+	t2 = _mm_srli_epi64( t0, 16- 6 );
+	t3 = _mm_srli_epi64( t0, 24- 9 );
+	t4 = _mm_srli_epi64( t0, 32-12 );
+	t5 = _mm_srli_epi64( t0, 40-15 );
+	t6 = _mm_srli_epi64( t0, 48-18 );
+	t7 = _mm_srli_epi64( t0, 56-21 );
+	t0 = _mm_and_si128( t0, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask0 ) );
+	t1 = _mm_and_si128( t1, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask1 ) );
+	t2 = _mm_and_si128( t2, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask2 ) );
+	t3 = _mm_and_si128( t3, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask3 ) );
+	t4 = _mm_and_si128( t4, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask4 ) );
+	t5 = _mm_and_si128( t5, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask5 ) );
+	t6 = _mm_and_si128( t6, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask6 ) );
+	t7 = _mm_and_si128( t7, _mm_load_si128 ( (__m128i*) SIMD_SSE2_dword_alpha_bit_mask7 ) );
+	t0 = _mm_or_si128( t0, t1 );
+	t2 = _mm_or_si128( t2, t3 );
+	t4 = _mm_or_si128( t4, t5 );
+	t6 = _mm_or_si128( t6, t7 );
+	t0 = _mm_or_si128( t0, t2 );
+	t4 = _mm_or_si128( t4, t6 );
+	t0 = _mm_or_si128( t0, t4 );
+
+	// 24 bits from each qword. The asm stored a dword at +0 and +3, which writes one byte past the block.
+	int lo = _mm_cvtsi128_si32( t0 );
+	int hi = _mm_cvtsi128_si32( _mm_shuffle_epi32( t0, R_SHUFFLE_D( 2, 3, 0, 1 ) ) );
+	memcpy( outData+0, &lo, 3 );
+	memcpy( outData+3, &hi, 3 );
+
+	outData += 6;
 }
 
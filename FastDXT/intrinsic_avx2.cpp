@@ -0,0 +1,222 @@
+/******************************************************************************
+ * Fast DXT - a realtime DXT compression tool
+ *
+ * Author : Luc Renambot
+ *
+ * Copyright (C) 2007 Electronic Visualization Laboratory,
+ * University of Illinois at Chicago
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either Version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License along
+ * with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ *****************************************************************************/
+
+/*
+	AVX2 version of the SSE2 code in intrinsic.cpp, encoding two neighbouring
+	blocks at once. Every instruction used works within 128-bit lanes, so each
+	lane runs exactly the SSE2 algorithm on its own block and the output is
+	bit-identical. The functions carry their own target attribute, so the
+	rest of the program doesn't need to be built with -mavx2.
+*/
+
+#include "dxt.h"
+
+#if defined(DXT_AVX)
+#include <immintrin.h>
+
+#define R_SHUFFLE_D( x, y, z, w ) (( (w) & 3 ) << 6 | ( (z) & 3 ) << 4 | ( (y) & 3 ) << 2 | ( (x) & 3 ))
+#define AVX2 __attribute__((target("avx2")))
+
+void EmitWord( word s, byte*& );
+void EmitDoubleWord( dword i, byte*& );
+word ColorTo565( const byte *color );
+
+
+// Row j of the first block goes in the low lane of colorBlock[j*32], and the second block in the high lane.
+static inline AVX2 void ExtractBlocks_AVX2( const byte *inPtr, int width, byte *colorBlock )
+{
+	int w = width << 2;
+
+	for ( int j = 0; j < 4; j++, inPtr += w ) {
+		__m256i t0 = _mm256_loadu_si256 ( (__m256i*) inPtr );
+		_mm256_store_si256 ( (__m256i*) &colorBlock[j*32], t0 );
+	}
+}
+
+static inline AVX2 void GetMinMaxColors_AVX2( const byte *colorBlock, byte *minColor, byte *maxColor )
+{
+	__m256i t0, t1, t2, t3, t4;
+
+	// get bounding box
+	t0 = _mm256_load_si256 ( (__m256i*) colorBlock );
+	t1 = t0;
+	for ( int j = 32; j < 128; j += 32 ) {
+		__m256i row = _mm256_load_si256 ( (__m256i*) (colorBlock+j) );
+		t0 = _mm256_min_epu8 ( t0, row );
+		t1 = _mm256_max_epu8 ( t1, row );
+	}
+
+	t3 = _mm256_shuffle_epi32( t0, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t4 = _mm256_shuffle_epi32( t1, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t0 = _mm256_min_epu8 ( t0, t3 );
+	t1 = _mm256_max_epu8 ( t1, t4 );
+
+	t3 = _mm256_shufflelo_epi16( t0, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t4 = _mm256_shufflelo_epi16( t1, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t0 = _mm256_min_epu8 ( t0, t3 );
+	t1 = _mm256_max_epu8 ( t1, t4 );
+
+	// inset the bounding box
+	__m256i zero = _mm256_setzero_si256();
+	t0 = _mm256_unpacklo_epi8( t0, zero );
+	t1 = _mm256_unpacklo_epi8( t1, zero );
+
+	t2 = _mm256_sub_epi16( t1, t0 );
+	t2 = _mm256_srli_epi16( t2, INSET_SHIFT );
+	t0 = _mm256_add_epi16( t0, t2 );
+	t1 = _mm256_sub_epi16( t1, t2 );
+
+	t0 = _mm256_packus_epi16( t0, t0 );
+	t1 = _mm256_packus_epi16( t1, t1 );
+
+	// store bounding box extents, one block per 16 bytes
+	_mm256_store_si256 ( (__m256i*) minColor, t0 );
+	_mm256_store_si256 ( (__m256i*) maxColor, t1 );
+}
+
+// Converts the colour in the low 3 bytes of each lane to 565 and back, as words.
+static inline AVX2 __m256i Color565_AVX2( const byte *color )
+{
+	__m256i mask = _mm256_setr_epi8( C565_5_MASK, C565_6_MASK, C565_5_MASK, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+					 C565_5_MASK, C565_6_MASK, C565_5_MASK, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+	__m256i t0, t4, t5;
+
+	t0 = _mm256_load_si256 ( (__m256i*) color );
+	t0 = _mm256_and_si256( t0, mask );
+	t0 = _mm256_unpacklo_epi8( t0, _mm256_setzero_si256() );
+
+	t4 = _mm256_shufflelo_epi16( t0, R_SHUFFLE_D( 0, 3, 2, 3 ) );
+	t5 = _mm256_shufflelo_epi16( t0, R_SHUFFLE_D( 3, 1, 3, 3 ) );
+	t4 = _mm256_srli_epi16( t4, 5 );
+	t5 = _mm256_srli_epi16( t5, 6 );
+
+	t0 = _mm256_or_si256( t0, t4 );
+	return _mm256_or_si256( t0, t5 );
+}
+
+// Sum of absolute differences of 4 pixels against each palette entry, packed to words.
+static inline AVX2 void Distances_AVX2( __m256i row, const __m256i *palette, __m256i *d )
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_shuffle_epi32( _mm256_unpacklo_epi64( row, zero ), R_SHUFFLE_D( 0, 2, 1, 3 ) );
+	__m256i hi = _mm256_shuffle_epi32( _mm256_unpackhi_epi64( row, zero ), R_SHUFFLE_D( 0, 2, 1, 3 ) );
+
+	for ( int c = 0; c < 4; c++ ) {
+		d[c] = _mm256_packs_epi32( _mm256_sad_epu8( lo, palette[c] ), _mm256_sad_epu8( hi, palette[c] ) );
+	}
+}
+
+static inline AVX2 void EmitColorIndices_AVX2( const byte *colorBlock, const byte *minColor, const byte *maxColor, dword *indices )
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i t0, t1, t2, t3, t4, t5, t7;
+	__m256i palette[4];
+
+	t0 = Color565_AVX2( maxColor );   // color0
+	t1 = Color565_AVX2( minColor );   // color1
+
+	palette[0] = _mm256_shuffle_epi32( _mm256_packus_epi16( t0, zero ), R_SHUFFLE_D( 0, 1, 0, 1 ) );
+	palette[1] = _mm256_shuffle_epi32( _mm256_packus_epi16( t1, zero ), R_SHUFFLE_D( 0, 1, 0, 1 ) );
+
+	__m256i div3 = _mm256_set1_epi16( (1<<16)/3+1 );
+	t2 = _mm256_add_epi16( _mm256_add_epi16( t0, t0 ), t1 );
+	t2 = _mm256_packus_epi16( _mm256_mulhi_epi16( t2, div3 ), zero );
+	palette[2] = _mm256_shuffle_epi32( t2, R_SHUFFLE_D( 0, 1, 0, 1 ) );
+
+	t3 = _mm256_add_epi16( _mm256_add_epi16( t1, t1 ), t0 );
+	t3 = _mm256_packus_epi16( _mm256_mulhi_epi16( t3, div3 ), zero );
+	palette[3] = _mm256_shuffle_epi32( t3, R_SHUFFLE_D( 0, 1, 0, 1 ) );
+
+	__m256i w1 = _mm256_set1_epi16( 1 );
+	__m256i w2 = _mm256_set1_epi16( 2 );
+
+	// rows 2 and 3 first, then 0 and 1, like the SSE2 loop
+	t7 = zero;
+	for ( int x = 64; x >= 0; x -= 64 ) {
+		__m256i a[4], b[4];
+		Distances_AVX2( _mm256_load_si256 ( (__m256i*) (colorBlock+x) ), palette, a );
+		Distances_AVX2( _mm256_load_si256 ( (__m256i*) (colorBlock+x+32) ), palette, b );
+
+		t0 = _mm256_packs_epi32( a[0], b[0] );  // d0
+		t1 = _mm256_packs_epi32( a[1], b[1] );  // d1
+		t2 = _mm256_packs_epi32( a[2], b[2] );  // d2
+		t3 = _mm256_packs_epi32( a[3], b[3] );  // d3
+
+		t7 = _mm256_slli_epi32( t7, 16 );
+
+		t4 = _mm256_cmpgt_epi16( t0, t2 ); // b2
+		t5 = _mm256_cmpgt_epi16( t1, t3 ); // b3
+		t0 = _mm256_cmpgt_epi16( t0, t3 ); // b0
+		t1 = _mm256_cmpgt_epi16( t1, t2 ); // b1
+		t2 = _mm256_cmpgt_epi16( t2, t3 ); // b4
+
+		t4 = _mm256_and_si256( t4, t1 ); // x0
+		t5 = _mm256_and_si256( t5, t0 ); // x1
+		t2 = _mm256_and_si256( t2, t0 ); // x2
+
+		t4 = _mm256_or_si256( t4, t5 );
+		t2 = _mm256_and_si256( t2, w1 );
+		t4 = _mm256_and_si256( t4, w2 );
+		t2 = _mm256_or_si256( t2, t4 );
+
+		t5 = _mm256_shuffle_epi32( t2, R_SHUFFLE_D( 2, 3, 0, 1 ) );
+		t2 = _mm256_unpacklo_epi16( t2, zero );
+		t5 = _mm256_unpacklo_epi16( t5, zero );
+		t5 = _mm256_slli_epi32( t5, 8 );
+
+		t7 = _mm256_or_si256( t7, t5 );
+		t7 = _mm256_or_si256( t7, t2 );
+	}
+
+	t4 = _mm256_shuffle_epi32( t7, R_SHUFFLE_D( 1, 2, 3, 0 ) );
+	t5 = _mm256_shuffle_epi32( t7, R_SHUFFLE_D( 2, 3, 0, 1 ) );
+	t0 = _mm256_shuffle_epi32( t7, R_SHUFFLE_D( 3, 0, 1, 2 ) );
+
+	t7 = _mm256_or_si256( t7, _mm256_slli_epi32( t4, 2 ) );
+	t7 = _mm256_or_si256( t7, _mm256_slli_epi32( t5, 4 ) );
+	t7 = _mm256_or_si256( t7, _mm256_slli_epi32( t0, 6 ) );
+
+	indices[0] = _mm256_extract_epi32( t7, 0 );
+	indices[1] = _mm256_extract_epi32( t7, 4 );
+}
+
+void AVX2 CompressBlocksDXT1_AVX2( const byte *inPtr, int width, byte *&outData )
+{
+	ALIGN32( byte block[128] );
+	ALIGN32( byte minColor[32] );
+	ALIGN32( byte maxColor[32] );
+	dword indices[2];
+
+	ExtractBlocks_AVX2( inPtr, width, block );
+	GetMinMaxColors_AVX2( block, minColor, maxColor );
+	EmitColorIndices_AVX2( block, minColor, maxColor, indices );
+
+	for ( int k = 0; k < 2; k++ ) {
+		EmitWord( ColorTo565( maxColor + k*16 ), outData );
+		EmitWord( ColorTo565( minColor + k*16 ), outData );
+		EmitDoubleWord( indices[k], outData );
+	}
+}
+
+#endif
@@ -0,0 +1,229 @@
+/******************************************************************************
+ * Fast DXT - a realtime DXT compression tool
+ *
+ * Author : Luc Renambot
+ *
+ * Copyright (C) 2007 Electronic Visualization Laboratory,
+ * University of Illinois at Chicago
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either Version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser Public License along
+ * with this library; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ *****************************************************************************/
+
+/*
+	AVX-512 version of the SSE2 code in intrinsic.cpp, encoding four
+	neighbouring blocks at once. As with the AVX2 version each 128-bit lane
+	runs the SSE2 algorithm on its own block, so the output is bit-identical.
+	Needs AVX-512F and AVX-512BW.
+*/
+
+#include "dxt.h"
+
+#if defined(DXT_AVX)
+#include <immintrin.h>
+
+// GCC warns that the shuffle and unpack intrinsics use the result of _mm512_undefined_epi32
+// uninitialised when they're inlined with optimisation on. That's what it's for.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+#define R_SHUFFLE_D( x, y, z, w ) (( (w) & 3 ) << 6 | ( (z) & 3 ) << 4 | ( (y) & 3 ) << 2 | ( (x) & 3 ))
+#define AVX512 __attribute__((target("avx512f,avx512bw")))
+#define SHUFFLE_D_AVX512( a, imm ) _mm512_shuffle_epi32( a, (_MM_PERM_ENUM)(imm) )
+
+void EmitWord( word s, byte*& );
+void EmitDoubleWord( dword i, byte*& );
+word ColorTo565( const byte *color );
+
+
+// Row j of block k goes in lane k of colorBlock[j*64].
+static inline AVX512 void ExtractBlocks_AVX512( const byte *inPtr, int width, byte *colorBlock )
+{
+	int w = width << 2;
+
+	for ( int j = 0; j < 4; j++, inPtr += w ) {
+		__m512i t0 = _mm512_loadu_si512 ( (__m512i*) inPtr );
+		_mm512_store_si512 ( (__m512i*) &colorBlock[j*64], t0 );
+	}
+}
+
+static inline AVX512 void GetMinMaxColors_AVX512( const byte *colorBlock, byte *minColor, byte *maxColor )
+{
+	__m512i t0, t1, t2, t3, t4;
+
+	// get bounding box
+	t0 = _mm512_load_si512 ( (__m512i*) colorBlock );
+	t1 = t0;
+	for ( int j = 64; j < 256; j += 64 ) {
+		__m512i row = _mm512_load_si512 ( (__m512i*) (colorBlock+j) );
+		t0 = _mm512_min_epu8 ( t0, row );
+		t1 = _mm512_max_epu8 ( t1, row );
+	}
+
+	t3 = SHUFFLE_D_AVX512( t0, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t4 = SHUFFLE_D_AVX512( t1, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t0 = _mm512_min_epu8 ( t0, t3 );
+	t1 = _mm512_max_epu8 ( t1, t4 );
+
+	t3 = _mm512_shufflelo_epi16( t0, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t4 = _mm512_shufflelo_epi16( t1, R_SHUFFLE_D( 2, 3, 2, 3 ) );
+	t0 = _mm512_min_epu8 ( t0, t3 );
+	t1 = _mm512_max_epu8 ( t1, t4 );
+
+	// inset the bounding box
+	__m512i zero = _mm512_setzero_si512();
+	t0 = _mm512_unpacklo_epi8( t0, zero );
+	t1 = _mm512_unpacklo_epi8( t1, zero );
+
+	t2 = _mm512_sub_epi16( t1, t0 );
+	t2 = _mm512_srli_epi16( t2, INSET_SHIFT );
+	t0 = _mm512_add_epi16( t0, t2 );
+	t1 = _mm512_sub_epi16( t1, t2 );
+
+	t0 = _mm512_packus_epi16( t0, t0 );
+	t1 = _mm512_packus_epi16( t1, t1 );
+
+	// store bounding box extents, one block per 16 bytes
+	_mm512_store_si512 ( (__m512i*) minColor, t0 );
+	_mm512_store_si512 ( (__m512i*) maxColor, t1 );
+}
+
+// Converts the colour in the low 3 bytes of each lane to 565 and back, as words.
+static inline AVX512 __m512i Color565_AVX512( const byte *color )
+{
+	__m512i mask = _mm512_broadcast_i32x4( _mm_setr_epi8( C565_5_MASK, C565_6_MASK, C565_5_MASK, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 ) );
+	__m512i t0, t4, t5;
+
+	t0 = _mm512_load_si512 ( (__m512i*) color );
+	t0 = _mm512_and_si512( t0, mask );
+	t0 = _mm512_unpacklo_epi8( t0, _mm512_setzero_si512() );
+
+	t4 = _mm512_shufflelo_epi16( t0, R_SHUFFLE_D( 0, 3, 2, 3 ) );
+	t5 = _mm512_shufflelo_epi16( t0, R_SHUFFLE_D( 3, 1, 3, 3 ) );
+	t4 = _mm512_srli_epi16( t4, 5 );
+	t5 = _mm512_srli_epi16( t5, 6 );
+
+	t0 = _mm512_or_si512( t0, t4 );
+	return _mm512_or_si512( t0, t5 );
+}
+
+// Sum of absolute differences of 4 pixels against each palette entry, packed to words.
+static inline AVX512 void Distances_AVX512( __m512i row, const __m512i *palette, __m512i *d )
+{
+	__m512i zero = _mm512_setzero_si512();
+	__m512i lo = SHUFFLE_D_AVX512( _mm512_unpacklo_epi64( row, zero ), R_SHUFFLE_D( 0, 2, 1, 3 ) );
+	__m512i hi = SHUFFLE_D_AVX512( _mm512_unpackhi_epi64( row, zero ), R_SHUFFLE_D( 0, 2, 1, 3 ) );
+
+	for ( int c = 0; c < 4; c++ ) {
+		d[c] = _mm512_packs_epi32( _mm512_sad_epu8( lo, palette[c] ), _mm512_sad_epu8( hi, palette[c] ) );
+	}
+}
+
+static inline AVX512 void EmitColorIndices_AVX512( const byte *colorBlock, const byte *minColor, const byte *maxColor, dword *indices )
+{
+	__m512i zero = _mm512_setzero_si512();
+	__m512i t0, t1, t2, t3, t4, t5, t7;
+	__m512i palette[4];
+
+	t0 = Color565_AVX512( maxColor );   // color0
+	t1 = Color565_AVX512( minColor );   // color1
+
+	palette[0] = SHUFFLE_D_AVX512( _mm512_packus_epi16( t0, zero ), R_SHUFFLE_D( 0, 1, 0, 1 ) );
+	palette[1] = SHUFFLE_D_AVX512( _mm512_packus_epi16( t1, zero ), R_SHUFFLE_D( 0, 1, 0, 1 ) );
+
+	__m512i div3 = _mm512_set1_epi16( (1<<16)/3+1 );
+	t2 = _mm512_add_epi16( _mm512_add_epi16( t0, t0 ), t1 );
+	t2 = _mm512_packus_epi16( _mm512_mulhi_epi16( t2, div3 ), zero );
+	palette[2] = SHUFFLE_D_AVX512( t2, R_SHUFFLE_D( 0, 1, 0, 1 ) );
+
+	t3 = _mm512_add_epi16( _mm512_add_epi16( t1, t1 ), t0 );
+	t3 = _mm512_packus_epi16( _mm512_mulhi_epi16( t3, div3 ), zero );
+	palette[3] = SHUFFLE_D_AVX512( t3, R_SHUFFLE_D( 0, 1, 0, 1 ) );
+
+	__m512i w1 = _mm512_set1_epi16( 1 );
+	__m512i w2 = _mm512_set1_epi16( 2 );
+
+	// rows 2 and 3 first, then 0 and 1, like the SSE2 loop
+	t7 = zero;
+	for ( int x = 128; x >= 0; x -= 128 ) {
+		__m512i a[4], b[4];
+		Distances_AVX512( _mm512_load_si512 ( (__m512i*) (colorBlock+x) ), palette, a );
+		Distances_AVX512( _mm512_load_si512 ( (__m512i*) (colorBlock+x+64) ), palette, b );
+
+		t0 = _mm512_packs_epi32( a[0], b[0] );  // d0
+		t1 = _mm512_packs_epi32( a[1], b[1] );  // d1
+		t2 = _mm512_packs_epi32( a[2], b[2] );  // d2
+		t3 = _mm512_packs_epi32( a[3], b[3] );  // d3
+
+		t7 = _mm512_slli_epi32( t7, 16 );
+
+		t4 = _mm512_movm_epi16( _mm512_cmpgt_epi16_mask( t0, t2 ) ); // b2
+		t5 = _mm512_movm_epi16( _mm512_cmpgt_epi16_mask( t1, t3 ) ); // b3
+		t0 = _mm512_movm_epi16( _mm512_cmpgt_epi16_mask( t0, t3 ) ); // b0
+		t1 = _mm512_movm_epi16( _mm512_cmpgt_epi16_mask( t1, t2 ) ); // b1
+		t2 = _mm512_movm_epi16( _mm512_cmpgt_epi16_mask( t2, t3 ) ); // b4
+
+		t4 = _mm512_and_si512( t4, t1 ); // x0
+		t5 = _mm512_and_si512( t5, t0 ); // x1
+		t2 = _mm512_and_si512( t2, t0 ); // x2
+
+		t4 = _mm512_or_si512( t4, t5 );
+		t2 = _mm512_and_si512( t2, w1 );
+		t4 = _mm512_and_si512( t4, w2 );
+		t2 = _mm512_or_si512( t2, t4 );
+
+		t5 = SHUFFLE_D_AVX512( t2, R_SHUFFLE_D( 2, 3, 0, 1 ) );
+		t2 = _mm512_unpacklo_epi16( t2, zero );
+		t5 = _mm512_unpacklo_epi16( t5, zero );
+		t5 = _mm512_slli_epi32( t5, 8 );
+
+		t7 = _mm512_or_si512( t7, t5 );
+		t7 = _mm512_or_si512( t7, t2 );
+	}
+
+	t4 = SHUFFLE_D_AVX512( t7, R_SHUFFLE_D( 1, 2, 3, 0 ) );
+	t5 = SHUFFLE_D_AVX512( t7, R_SHUFFLE_D( 2, 3, 0, 1 ) );
+	t0 = SHUFFLE_D_AVX512( t7, R_SHUFFLE_D( 3, 0, 1, 2 ) );
+
+	t7 = _mm512_or_si512( t7, _mm512_slli_epi32( t4, 2 ) );
+	t7 = _mm512_or_si512( t7, _mm512_slli_epi32( t5, 4 ) );
+	t7 = _mm512_or_si512( t7, _mm512_slli_epi32( t0, 6 ) );
+
+	ALIGN64( dword result[16] );
+	_mm512_store_si512 ( (__m512i*) result, t7 );
+	for ( int k = 0; k < 4; k++ ) indices[k] = result[k*4];
+}
+
+void AVX512 CompressBlocksDXT1_AVX512( const byte *inPtr, int width, byte *&outData )
+{
+	ALIGN64( byte block[256] );
+	ALIGN64( byte minColor[64] );
+	ALIGN64( byte maxColor[64] );
+	dword indices[4];
+
+	ExtractBlocks_AVX512( inPtr, width, block );
+	GetMinMaxColors_AVX512( block, minColor, maxColor );
+	EmitColorIndices_AVX512( block, minColor, maxColor, indices );
+
+	for ( int k = 0; k < 4; k++ ) {
+		EmitWord( ColorTo565( maxColor + k*16 ), outData );
+		EmitWord( ColorTo565( minColor + k*16 ), outData );
+		EmitDoubleWord( indices[k], outData );
+	}
+}
+
+#pragma GCC diagnostic pop
+#endif
@@ -31,86 +31,219 @@
 #endif
 
 #include <pthread.h>
+#include <atomic>
+#include <list>
 
+// A conversion is split into stripes of one block row (4 pixel rows) each.
+// Stripes are claimed from a shared counter by the calling thread and by any
+// idle thread of a persistent pool, so every stripe lands at a fixed output
+// offset and the result is identical to the single-threaded encoder.
+// Jobs from DXTParallel use the same machinery, with a task per stripe.
 typedef struct _work_t {
 	int width, height;
-	int nbb;
-	byte *in, *out;
+	int format;
+	int stripes;
+	int stripebytes;
+	int maxworkers;
+	int active;
+	int done;
+	const volatile int *priority;
+	int base;
+	std::atomic<int> next;
+	const byte *in;
+	byte *out;
+	void (*task)(void *arg, int index);
+	void *arg;
 } work_t;
 
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER;
+static std::list<work_t*> poolqueue;
+static int poolthreads = 0;
+static thread_local const volatile int *dxtpriority = NULL;
+static thread_local int dxtbase = 0;
 
-
-void *slave1(void *arg)
+void DXTSetPriority(const volatile int *priority, int base)
 {
-	work_t *param = (work_t*) arg;
-	int nbbytes = 0;
-	CompressImageDXT1( param->in, param->out, param->width, param->height, nbbytes);
-	param->nbb = nbbytes;
-	return NULL;
+  dxtpriority = priority;
+  dxtbase = base;
 }
 
-void *slave5(void *arg)
+static void (*threadinit)(void) = NULL;
+
+void DXTSetThreadInit(void (*init)(void))
 {
-	work_t *param = (work_t*) arg;
-	int nbbytes = 0;
-	CompressImageDXT5( param->in, param->out, param->width, param->height, nbbytes);
-	param->nbb = nbbytes;	
-	return NULL;
+  threadinit = init;
 }
 
-void *slave5ycocg(void *arg)
+
+static void encodestripe(work_t *job, int stripe)
 {
-	work_t *param = (work_t*) arg;
-	int nbbytes = 0;
-	CompressImageDXT5YCoCg( param->in, param->out, param->width, param->height, nbbytes);
-	param->nbb = nbbytes;
-	return NULL;
+  if (job->task) {
+    job->task(job->arg, stripe);
+    return;
+  }
+
+  int nbbytes = 0;
+  const byte *in = job->in + stripe * job->width * 4 * 4;
+  byte *out = job->out + stripe * job->stripebytes;
+  int rows = (job->height - stripe * 4 < 4) ? job->height - stripe * 4 : 4;
+
+  switch (job->format) {
+  case FORMAT_DXT1:
+    CompressImageDXT1(in, out, job->width, rows, nbbytes);
+    break;
+  case FORMAT_DXT5:
+    CompressImageDXT5(in, out, job->width, rows, nbbytes);
+    break;
+  case FORMAT_DXT5YCOCG:
+    CompressImageDXT5YCoCg(in, out, job->width, rows, nbbytes);
+    break;
+  case FORMAT_DXT1A:
+    CompressImageDXT1a(in, out, job->width, rows, nbbytes);
+    break;
+  }
 }
 
-int CompressDXT(const byte *in, byte *out, int width, int height, int format, int numthreads)
+// Claim and encode stripes until none are left, returns how many were done.
+static int runstripes(work_t *job)
 {
-  pthread_t *pid;
-  work_t    *job;
-  int        nbbytes;
-
-  if ( (numthreads!=1) && (numthreads!=2) && (numthreads!=4) ) {
-	fprintf(stderr, "DXT> Errror, number of thread should be 1, 2 or 4\n");
-	return 0;
+  int count = 0;
+  int stripe;
+  while ((stripe = job->next++) < job->stripes) {
+    encodestripe(job, stripe);
+    count++;
   }
+  return count;
+}
 
-  job = new work_t[numthreads];
-  pid = new pthread_t[numthreads];
-
-  for (int k=0;k<numthreads;k++)
-    {
-      job[k].width = width;
-      job[k].height = height/numthreads;
-      job[k].nbb = 0;
-      job[k].in =  (byte*)in  + (k*width*4*height/numthreads);
-      if (format == FORMAT_DXT1)
-	job[k].out = out + (k*width*4*height/(numthreads*8));
-      else
-	job[k].out = out + (k*width*4*height/(numthreads*4));
-
-      switch (format) {
-      case FORMAT_DXT1:
-	pthread_create(&pid[k], NULL, slave1, &job[k]);
-	break;
-      case FORMAT_DXT5:
-	pthread_create(&pid[k], NULL, slave5, &job[k]);
-	break;
-      case FORMAT_DXT5YCOCG:
-	pthread_create(&pid[k], NULL, slave5ycocg, &job[k]);
-	break;
+static void *slave(void *arg)
+{
+  if (threadinit) threadinit();
+  pthread_mutex_lock(&poollock);
+  while (1) {
+    // Help whichever image somebody is waiting on the most, oldest first.
+    work_t *job = NULL;
+    int best = -1;
+    for (std::list<work_t*>::iterator i = poolqueue.begin(); i != poolqueue.end(); i++) {
+      int prio = (*i)->base + ((*i)->priority ? *(*i)->priority : 0);
+      if ((*i)->active < (*i)->maxworkers && prio > best) {
+	job = *i;
+	best = prio;
       }
     }
+    if (!job) {
+      pthread_cond_wait(&poolwork, &poollock);
+      continue;
+    }
+
+    job->active++;
+    pthread_mutex_unlock(&poollock);
 
-  // Join all the threads
-  nbbytes = 0;
-  for (int k=0;k<numthreads;k++)
-  {
-    pthread_join(pid[k], NULL);
-    nbbytes += job[k].nbb;
+    int count = runstripes(job);
+
+    pthread_mutex_lock(&poollock);
+    poolqueue.remove(job);
+    job->active--;
+    job->done += count;
+    if (job->done == job->stripes && job->active == 0)
+      pthread_cond_broadcast(&pooldone);
+  }
+  return NULL;
+}
+
+// Grow the pool so that up to numthreads threads (including the caller) can
+// work on one image. Threads are created lazily so that they belong to the
+// process which actually does the encoding, not one which later forks.
+static void growpool(int numthreads)
+{
+  pthread_mutex_lock(&poollock);
+  while (poolthreads < numthreads - 1) {
+    pthread_t pid;
+    if (pthread_create(&pid, NULL, slave, NULL) != 0) {
+      fprintf(stderr, "DXT> Could not start worker thread %d\n", poolthreads);
+      break;
+    }
+    pthread_detach(pid);
+    poolthreads++;
   }
-  return nbbytes;
+  pthread_mutex_unlock(&poollock);
+}
+
+// Hand the job to the pool and work on it until every stripe is done.
+// Low priority callers may be running at idle priority, which new pool
+// threads would inherit, so they only get help from threads already there.
+static void runjob(work_t *job, int numthreads)
+{
+  if (job->base >= 0) growpool(numthreads);
+
+  pthread_mutex_lock(&poollock);
+  poolqueue.push_back(job);
+  pthread_cond_broadcast(&poolwork);
+  pthread_mutex_unlock(&poollock);
+
+  int count = runstripes(job);
+
+  pthread_mutex_lock(&poollock);
+  poolqueue.remove(job);
+  job->done += count;
+  while (job->done < job->stripes || job->active > 0)
+    pthread_cond_wait(&pooldone, &poollock);
+  pthread_mutex_unlock(&poollock);
+}
+
+int CompressDXT(const byte *in, byte *out, int width, int height, int format, int numthreads)
+{
+  work_t job;
+
+  job.width = width;
+  job.height = height;
+  job.format = format;
+  job.stripes = (height + 3) / 4;
+  job.stripebytes = (width / 4) * ((format == FORMAT_DXT1 || format == FORMAT_DXT1A) ? 8 : 16);
+  job.maxworkers = numthreads - 1;
+  job.active = 0;
+  job.done = 0;
+  job.priority = dxtpriority;
+  job.base = dxtbase;
+  job.next = 0;
+  job.in = in;
+  job.out = out;
+  job.task = NULL;
+  job.arg = NULL;
+
+  // Small levels finish faster than it takes to wake anybody up.
+  if (numthreads <= 1 || job.stripes < 2 || width * height < 128 * 128)
+    runstripes(&job);
+  else
+    runjob(&job, numthreads);
+
+  return job.stripes * job.stripebytes;
+}
+
+void DXTParallel(void (*task)(void *arg, int index), void *arg, int count, int numthreads)
+{
+  work_t job;
+
+  job.width = 0;
+  job.height = 0;
+  job.format = 0;
+  job.stripes = count;
+  job.stripebytes = 0;
+  job.maxworkers = numthreads - 1;
+  job.active = 0;
+  job.done = 0;
+  job.priority = dxtpriority;
+  job.base = dxtbase;
+  job.next = 0;
+  job.in = NULL;
+  job.out = NULL;
+  job.task = task;
+  job.arg = arg;
+
+  if (numthreads <= 1 || count < 2)
+    runstripes(&job);
+  else
+    runjob(&job, numthreads);
 }
@@ -28,8 +28,24 @@
 #define FORMAT_DXT1      1
 #define FORMAT_DXT5      2
 #define FORMAT_DXT5YCOCG 3
+#define FORMAT_DXT1A     4
 
 
+// Compress one image, sharing the work between the caller and up to
+// numthreads-1 threads of a persistent pool. Returns the bytes written.
 int CompressDXT(const byte *in, byte *out, int width, int height, int format, int numthreads);
 
+// Call task(arg, i) for every i below count, shared out the same way as the
+// stripes of CompressDXT. Tasks may run in any order and at the same time.
+void DXTParallel(void (*task)(void *arg, int index), void *arg, int count, int numthreads);
+
+// Images compressed by this thread are helped first when base + *priority is
+// larger than that of other queued images. Ones below zero are never helped,
+// and only use the calling thread. Pass NULL and 0 to clear.
+void DXTSetPriority(const volatile int *priority, int base);
+
+// Called by each pool thread as it starts, so they can be set up like the
+// caller's own threads. Set it before the first image.
+void DXTSetThreadInit(void (*init)(void));
+
 
@@ -0,0 +1,117 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <map>
+#include <vector>
+#include <unordered_map>
+#include "ddsfs.h"
+using namespace std;
+
+// Buffers for file data, images and DDS output all come from here. Freed ones
+// are kept by size class for the next conversion, so a steady stream of
+// textures reuses the same pages instead of mapping and faulting in new ones.
+
+// Smallest class. Anything under it still gets a whole one.
+#define POOLMIN (64*1024)
+#define HUGEPAGE (2*1024*1024)
+
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static map<size_t, vector<void*> > idle;
+static unordered_map<void*, size_t> busy;
+static size_t idlebytes = 0;
+
+// Four classes per power of two, so a buffer is at most 25% bigger than asked for.
+static size_t sizeclass(size_t size) {
+	if (size <= POOLMIN) return POOLMIN;
+	size_t step = 1;
+	while (step <= size / 2) step <<= 1;
+	step >>= 2;
+	return (size + step - 1) & ~(step - 1);
+}
+
+static void* pool_map(size_t size) {
+	if (!config.hugepages || size < HUGEPAGE) {
+		void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return buf == MAP_FAILED ? NULL : buf;
+	}
+
+	// Transparent huge pages only cover aligned 2 MB ranges, so trim the mapping to start on one.
+	char* buf = (char*)mmap(NULL, size + HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) return NULL;
+	size_t lead = (HUGEPAGE - ((uintptr_t)buf & (HUGEPAGE - 1))) & (HUGEPAGE - 1);
+	if (lead) munmap(buf, lead);
+	munmap(buf + lead + size, HUGEPAGE - lead);
+#ifdef MADV_HUGEPAGE
+	madvise(buf + lead, size, MADV_HUGEPAGE);
+#endif
+	return buf + lead;
+}
+
+// Page aligned, which is more than any of the SIMD code needs.
+void* bufpool_get(size_t size) {
+	size_t cls = sizeclass(size);
+	void* buf = NULL;
+
+	pthread_mutex_lock(&poollock);
+	auto i = idle.find(cls);
+	if (i != idle.end() && !i->second.empty()) {
+		buf = i->second.back();
+		i->second.pop_back();
+		idlebytes -= cls;
+	}
+	pthread_mutex_unlock(&poollock);
+
+	if (!buf) {
+		buf = pool_map(cls);
+		if (!buf) {
+			fprintf(stderr, "bufpool: Could not map %zu bytes.\n", cls);
+			return NULL;
+		}
+		if (DEBUG >= 3) printf("bufpool: Mapped new %zu byte buffer.\n", cls);
+	}
+
+	pthread_mutex_lock(&poollock);
+	busy[buf] = cls;
+	pthread_mutex_unlock(&poollock);
+	return buf;
+}
+
+void bufpool_put(void* buf) {
+	if (!buf) return;
+
+	pthread_mutex_lock(&poollock);
+	auto i = busy.find(buf);
+	if (i == busy.end()) {
+		pthread_mutex_unlock(&poollock);
+		fprintf(stderr, "bufpool: Asked to free unknown buffer %p!\n", buf);
+		return;
+	}
+	size_t cls = i->second;
+	busy.erase(i);
+
+	int keep = idlebytes + cls <= (size_t)config.pool << 20;
+	if (keep) {
+		idle[cls].push_back(buf);
+		idlebytes += cls;
+	}
+	pthread_mutex_unlock(&poollock);
+
+	if (!keep) munmap(buf, cls);
+}
@@ -0,0 +1,543 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <list>
+#include <algorithm>
+#include <libdxt.h>
+#include "ddsfs.h"
+using namespace std;
+
+// Rows encoded, and halved for the next level, per task.
+#define TASKROWS 16
+
+enum {
+	JOB_QUEUED,
+	JOB_STARTED,
+	JOB_DONE,
+	JOB_FAILED,
+};
+
+struct ConvertJob {
+	string path;
+	string name;
+	string src;
+	int type;
+	int prio;
+	int state;
+	int err;
+	int fd;		// Handed to the opener once the size is known.
+	int ownfd;	// Keeps the entry alive until the conversion is finished.
+	int refs;
+	unsigned int bytes;	// Counted against -o bgmem while it's a background job.
+	int abandoned;	// Replaced by a foreground job while running, so its output is thrown away.
+	pthread_cond_t cond;
+};
+
+static pthread_mutex_t convertlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t convertwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t backgroundwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t foregrounddone = PTHREAD_COND_INITIALIZER;
+static list<ConvertJob*> convertqueue[CONVERT_CLASSES];
+// Jobs which haven't started output yet, so an open can take one over instead of starting its own.
+static unordered_map<string, ConvertJob*> pending;
+static unsigned int convertthreads = 0;
+static unsigned int backgroundthreads = 0;
+// Foreground conversions queued or running. Background ones wait while there are any.
+static int foreground = 0;
+// Expected output of background jobs queued or running.
+static unsigned long long backgroundbytes = 0;
+
+#ifdef __linux__
+static cpu_set_t affinity;
+static int affinityset = 0;
+#endif
+
+// The job being worked on by this thread, if it was started by convert_open.
+static thread_local ConvertJob* current = NULL;
+
+
+int ddsfs_convert(int type, char* src, unsigned char** dst) {
+	switch (type) {
+	#if USE_JPG
+	case SRC_JPG:
+		if (config.compress) return ddsfs_jpg_dxt1(src, dst);
+		return ddsfs_jpg_rgb(src, dst);
+	#endif
+	#if USE_WEBP
+	case SRC_WEBP:
+		if (config.compress) return ddsfs_webp_dxt1(src, dst);
+		return ddsfs_webp_rgb(src, dst);
+	#endif
+	#if USE_GZIP
+	case SRC_GZIP:
+		return ddsfs_gzip(src, dst);
+	#endif
+	#if USE_XZ
+	case SRC_XZ:
+		return ddsfs_xz(src, dst);
+	#endif
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+
+// Call with convertlock held, once a job stops being background work.
+static void job_unbudget(ConvertJob* job) {
+	backgroundbytes -= job->bytes;
+	job->bytes = 0;
+}
+
+static void job_release(ConvertJob* job) {
+	if (--job->refs == 0) {
+		pthread_cond_destroy(&job->cond);
+		delete job;
+	}
+}
+
+// Puts the buffer in memcache, hands the opener a handle to it if there is
+// one, and takes the job out of pending. The buffer then belongs to memcache.
+// Returns 0 with the buffer still the caller's if the job was abandoned.
+static int convert_publish(ConvertJob* job, unsigned char* dds, unsigned int len, unsigned int ready) {
+	pthread_mutex_lock(&convertlock);
+	if (job->abandoned) {
+		pthread_mutex_unlock(&convertlock);
+		return 0;
+	}
+	job->ownfd = memcache_reserve(job->name, dds, len, ready);
+	// Background jobs have nobody to hand a handle to.
+	int fd = job->prio == CONVERT_OPEN ? memcache_dup(job->ownfd) : 0;
+	DXTSetPriority(memcache_waiters(job->ownfd), job->prio == CONVERT_OPEN ? 0 : -1);
+	if (DEBUG >= 2) printf("convert: Started %u bytes for '%s' as FD %d.\n", len, job->name.c_str(), fd);
+	auto i = pending.find(job->name);
+	if (i != pending.end() && i->second == job) pending.erase(i);
+	job->fd = fd;
+	job->state = JOB_STARTED;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&convertlock);
+	return 1;
+}
+
+// Called by the converters once the output buffer exists and its header is
+// written. For a progressive open this publishes the buffer and lets the
+// opener return. Background jobs are only published once finished, so an open
+// never reads from a thread at idle priority, and until then it can take the
+// job over or abandon it. Returns 0 with the buffer still the converter's if
+// it isn't published.
+int convert_begin(unsigned char* dds, unsigned int len, unsigned int ready) {
+	ConvertJob* job = current;
+	if (!job || job->state != JOB_QUEUED || job->prio != CONVERT_OPEN) return 0;
+	return convert_publish(job, dds, len, ready);
+}
+
+// Background jobs stop here while foreground ones are going. Nobody reads
+// from them until they're finished, so there's no reason to carry on.
+static void convert_yield(ConvertJob* job) {
+	pthread_mutex_lock(&convertlock);
+	if (foreground > 0 && DEBUG >= 2) printf("convert: Pausing '%s' for foreground work.\n", job->name.c_str());
+	while (foreground > 0) pthread_cond_wait(&foregrounddone, &convertlock);
+	pthread_mutex_unlock(&convertlock);
+}
+
+void convert_progress(unsigned int ready) {
+	ConvertJob* job = current;
+	if (!job) return;
+	if (job->prio != CONVERT_OPEN) convert_yield(job);
+	if (job->state != JOB_STARTED) return;
+	memcache_progress(job->ownfd, ready);
+}
+
+struct CompressTask {
+	const unsigned char* rgba;
+	unsigned char* out;
+	unsigned char* next;
+	int width, height;
+	int format;
+	int blockrow;	// Output bytes per 4 rows.
+	int first;		// Task of the band being done.
+};
+
+// Encodes TASKROWS rows and, if there's a next level, halves them into it
+// while they're still in cache.
+static void compress_task(void* arg, int index) {
+	CompressTask* t = (CompressTask*)arg;
+	int row = (t->first + index) * TASKROWS;
+	int rows = std::min(TASKROWS, PADDED(t->height) - row);
+	const unsigned char* in = t->rgba + row * t->width * 4;
+	CompressDXT(in, t->out + (row / 4) * t->blockrow, t->width, rows, t->format, 1);
+	if (t->next && row < t->height) {
+		halveimage(in, t->width, std::min(TASKROWS, t->height - row), t->next + (row / 2) * (t->width / 2) * 4);
+	}
+}
+
+// Compresses a whole mip level, which has PADDED() rows and pitch. Rows are
+// handed out to the encoder pool a few at a time, and if next is given each
+// task also makes its part of the next level, so the downsample overlaps the
+// encode instead of following it. Sizes halveimage can't do are shrunk
+// afterwards. During a progressive open it goes in bands, so readers can have
+// the top of the image while the rest is encoded.
+int convert_compress(const unsigned char* rgba, unsigned char* out, int width, int height, int format, unsigned char* next, const unsigned char* dds) {
+	CompressTask task;
+	task.rgba = rgba;
+	task.out = out;
+	task.next = (next && width % 8 == 0 && height % 2 == 0) ? next : NULL;
+	task.width = PADDED(width);
+	task.height = height;
+	task.format = format;
+	task.blockrow = (task.width / 4) * ((format == FORMAT_DXT1 || format == FORMAT_DXT1A) ? 8 : 16);
+	
+	int rows = PADDED(height);
+	int tasks = (rows + TASKROWS - 1) / TASKROWS;
+	int band = current ? 256 / TASKROWS : tasks;
+	int threads = task.width * rows < 128 * 128 ? 1 : config.threads;
+	for (task.first = 0; task.first < tasks; task.first += band) {
+		DXTParallel(compress_task, &task, std::min(band, tasks - task.first), threads);
+		if (current) convert_progress(out + std::min(rows, (task.first + band) * TASKROWS) / 4 * task.blockrow - dds);
+	}
+	
+	if (task.next) padimage(next, width / 2, height / 2);
+	else if (next) shrinkimage(rgba, width, height, next);
+	return rows / 4 * task.blockrow;
+}
+
+
+static void convert_run(ConvertJob* job) {
+	unsigned char* dds = NULL;
+
+	current = job;
+	DXTSetPriority(NULL, job->prio == CONVERT_OPEN ? 0 : -1);
+	int len = ddsfs_convert(job->type, (char*)job->src.c_str(), &dds);
+	int err = errno;
+	current = NULL;
+	DXTSetPriority(NULL, 0);
+
+	if (len == -1) {
+		fprintf(stderr, "convert: Failed to convert '%s'.\n", job->src.c_str());
+		if (job->state == JOB_STARTED) {
+			memcache_fail(job->ownfd);
+			memcache_release(job->ownfd);
+		}
+		pthread_mutex_lock(&convertlock);
+		auto i = pending.find(job->name);
+		if (i != pending.end() && i->second == job) pending.erase(i);
+		job->state = JOB_FAILED;
+		job->err = err ? err : EIO;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&convertlock);
+		return;
+	}
+
+	// Converters which don't report progress, and background jobs, only show up
+	// once finished. Background ones are written to disk first, so they're
+	// there too by the time they leave pending.
+	int written = 0;
+	if (job->state == JOB_QUEUED) {
+		if (job->prio != CONVERT_OPEN && config.cache == CACHE_DISK) {
+			int fd = cache_write(job->path.c_str(), job->name.c_str(), dds, len);
+			if (fd != -1) close(fd);
+			written = 1;
+		}
+		int begun = convert_publish(job, dds, len, len);
+		DXTSetPriority(NULL, 0);
+		if (!begun) {
+			if (DEBUG >= 2) printf("convert: Dropping abandoned '%s'.\n", job->name.c_str());
+			bufpool_put(dds);
+			pthread_mutex_lock(&convertlock);
+			job->state = JOB_FAILED;
+			job->err = ECANCELED;
+			pthread_cond_broadcast(&job->cond);
+			pthread_mutex_unlock(&convertlock);
+			return;
+		}
+	}
+	memcache_progress(job->ownfd, len);
+	sizecache_set(job->name.c_str(), len);
+
+	if (config.cache == CACHE_DISK && !written) {
+		int fd = cache_write(job->path.c_str(), job->name.c_str(), dds, len);
+		if (fd != -1) close(fd);
+	}
+	memcache_release(job->ownfd);
+	if (DEBUG >= 2) printf("convert: Finished '%s'.\n", job->name.c_str());
+
+	pthread_mutex_lock(&convertlock);
+	job->state = JOB_DONE;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&convertlock);
+}
+
+#ifdef __linux__
+// Parses a list like "0-3,8" into a CPU set. Returns 0 if it's not one.
+static int parse_cpus(const char* list, cpu_set_t* cpus) {
+	CPU_ZERO(cpus);
+	while (*list) {
+		char* end;
+		long first = strtol(list, &end, 10);
+		if (end == list || first < 0) return 0;
+		long last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first) return 0;
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, cpus);
+		if (*end == ',') end++;
+		else if (*end) return 0;
+		list = end;
+	}
+	return CPU_COUNT(cpus) > 0;
+}
+#endif
+
+static void convert_pin();
+
+void convert_init() {
+#ifdef __linux__
+	if (config.affinity) {
+		affinityset = parse_cpus(config.affinity, &affinity);
+		if (!affinityset) fprintf(stderr, "convert: Could not parse CPU list '%s'.\n", config.affinity);
+	}
+	// The encoder's pool threads would otherwise take after whichever thread started them.
+	if (affinityset) DXTSetThreadInit(convert_pin);
+#endif
+}
+
+// Keeps the calling thread to -o affinity's CPUs. Only for threads ddsfs
+// starts itself, since it's never undone.
+static void convert_pin() {
+#ifdef __linux__
+	static thread_local int pinned = 0;
+	if (!affinityset || pinned) return;
+	if (pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity) != 0)
+		fprintf(stderr, "convert: Could not set CPU affinity.\n");
+	pinned = 1;
+#endif
+}
+
+// Background threads are dropped to idle priority. That can't be undone
+// without privileges, so background jobs get threads of their own.
+void convert_thread_setup(int background) {
+	convert_pin();
+#ifdef __linux__
+	if (background) {
+		if (config.bgnice) {
+			if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), config.bgnice) != 0)
+				fprintf(stderr, "convert: Could not set nice %d for background thread.\n", config.bgnice);
+		} else {
+			struct sched_param param;
+			param.sched_priority = 0;
+			if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+				fprintf(stderr, "convert: Could not set SCHED_IDLE for background thread.\n");
+		}
+	}
+#endif
+}
+
+static void* convert_thread(void* arg) {
+	int background = arg != NULL;
+	convert_thread_setup(background);
+
+	pthread_mutex_lock(&convertlock);
+	while (1) {
+		ConvertJob* job = NULL;
+		for (int prio = background ? CONVERT_PREFETCH : CONVERT_OPEN; prio < (background ? CONVERT_CLASSES : CONVERT_PREFETCH); prio++) {
+			if (!convertqueue[prio].empty()) {
+				job = convertqueue[prio].front();
+				convertqueue[prio].pop_front();
+				break;
+			}
+		}
+		if (!job) {
+			pthread_cond_wait(background ? &backgroundwork : &convertwork, &convertlock);
+			continue;
+		}
+		pthread_mutex_unlock(&convertlock);
+
+		convert_run(job);
+
+		pthread_mutex_lock(&convertlock);
+		if (job->prio == CONVERT_OPEN && --foreground == 0) pthread_cond_broadcast(&foregrounddone);
+		job_unbudget(job);
+		job_release(job);
+	}
+	return NULL;
+}
+
+// Started here rather than at mount, so they belong to the daemon and not the
+// process which forked it. Call with convertlock held.
+static void convert_start() {
+	while (convertthreads < config.workers) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, convert_thread, NULL) != 0) {
+			fprintf(stderr, "convert: Could not start worker thread %u.\n", convertthreads);
+			break;
+		}
+		pthread_detach(thread);
+		convertthreads++;
+	}
+	while (backgroundthreads < config.bgworkers) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, convert_thread, (void*)1) != 0) {
+			fprintf(stderr, "convert: Could not start background thread %u.\n", backgroundthreads);
+			break;
+		}
+		pthread_detach(thread);
+		backgroundthreads++;
+	}
+}
+
+static ConvertJob* job_new(const char* path, const char* rwpath, const char* src, int type, int prio) {
+	ConvertJob* job = new ConvertJob;
+	job->path = path;
+	job->name = rwpath;
+	job->src = src;
+	job->type = type;
+	job->prio = prio;
+	job->state = JOB_QUEUED;
+	job->err = 0;
+	job->fd = 0;
+	job->ownfd = 0;
+	job->refs = 1;
+	job->bytes = 0;
+	job->abandoned = 0;
+	pthread_cond_init(&job->cond, NULL);
+	return job;
+}
+
+// A background job for rwpath which is already running is left to finish
+// without anyone using it. Its thread is at idle priority or -o bgnice, so the
+// file is converted again in the foreground instead. It pauses at its next
+// convert_yield while that's going. Call with convertlock held.
+static void convert_abandon(const char* rwpath) {
+	auto i = pending.find(rwpath);
+	if (i == pending.end() || i->second->prio == CONVERT_OPEN) return;
+	list<ConvertJob*>& queue = convertqueue[i->second->prio];
+	if (std::find(queue.begin(), queue.end(), i->second) != queue.end()) return;
+	if (DEBUG >= 2) printf("convert: Abandoning running background job for '%s'.\n", rwpath);
+	i->second->abandoned = 1;
+	pending.erase(i);
+}
+
+// Queues a conversion and returns a memcache handle as soon as the converter
+// knows how big the output is. Reads on it wait for the bytes they need. A
+// queued background job for the same file is taken over instead, and a
+// running one abandoned. ddsfs_open only lets one open at a time get here for a file.
+int convert_open(const char* path, const char* rwpath, const char* src, int type) {
+	ConvertJob* job;
+
+	pthread_mutex_lock(&convertlock);
+	convert_start();
+
+	convert_abandon(rwpath);
+	auto i = pending.find(rwpath);
+	if (i != pending.end() && i->second->prio != CONVERT_OPEN) {
+		job = i->second;
+		list<ConvertJob*>& queue = convertqueue[job->prio];
+		if (DEBUG >= 2) printf("convert: Taking over queued background job for '%s'.\n", rwpath);
+		queue.erase(std::find(queue.begin(), queue.end(), job));
+		job->prio = CONVERT_OPEN;
+		job_unbudget(job);
+		convertqueue[CONVERT_OPEN].push_back(job);
+		pthread_cond_signal(&convertwork);
+	} else {
+		job = job_new(path, rwpath, src, type, CONVERT_OPEN);
+		pending[rwpath] = job;
+		convertqueue[CONVERT_OPEN].push_back(job);
+		pthread_cond_signal(&convertwork);
+	}
+	job->refs++;
+	foreground++;
+
+	while (job->state == JOB_QUEUED) pthread_cond_wait(&job->cond, &convertlock);
+
+	int ret = (job->state == JOB_FAILED) ? -job->err : job->fd;
+	job_release(job);
+	pthread_mutex_unlock(&convertlock);
+	return ret;
+}
+
+// Queues a conversion nobody is waiting for yet, as CONVERT_PREFETCH or
+// CONVERT_IDLE. The result goes to memcache and the disk cache like any other.
+// bytes is about how big it will be. Returns -EEXIST if the file is already on
+// its way, -ENOSPC if it would go over -o bgmem, or -ENOTSUP with -o bgworkers=0.
+int convert_queue(const char* path, const char* rwpath, const char* src, int type, int prio, unsigned int bytes) {
+	if (config.bgworkers == 0) return -ENOTSUP;
+	pthread_mutex_lock(&convertlock);
+	if (pending.find(rwpath) != pending.end()) {
+		pthread_mutex_unlock(&convertlock);
+		return -EEXIST;
+	}
+	if (config.bgmem && backgroundbytes + bytes > (unsigned long long)config.bgmem << 20) {
+		pthread_mutex_unlock(&convertlock);
+		return -ENOSPC;
+	}
+	convert_start();
+
+	ConvertJob* job = job_new(path, rwpath, src, type, prio);
+	job->bytes = bytes;
+	backgroundbytes += bytes;
+	pending[rwpath] = job;
+	convertqueue[prio].push_back(job);
+	pthread_cond_signal(&backgroundwork);
+	if (DEBUG >= 2) printf("convert: Queued '%s' in background class %d.\n", rwpath, prio);
+	pthread_mutex_unlock(&convertlock);
+	return 0;
+}
+
+// Converts in the calling thread for a non-progressive open. It counts as
+// foreground work, so background jobs make way for it, and one for the same
+// file that hasn't finished yet is dropped or abandoned.
+int convert_now(const char* rwpath, int type, char* src, unsigned char** dst) {
+	pthread_mutex_lock(&convertlock);
+	convert_abandon(rwpath);
+	auto i = pending.find(rwpath);
+	if (i != pending.end() && i->second->prio != CONVERT_OPEN) {
+		ConvertJob* job = i->second;
+		list<ConvertJob*>& queue = convertqueue[job->prio];
+		queue.erase(std::find(queue.begin(), queue.end(), job));
+		pending.erase(i);
+		job_unbudget(job);
+		job_release(job);
+	}
+	foreground++;
+	pthread_mutex_unlock(&convertlock);
+
+	// This is libfuse's thread, so it's only kept to -o affinity's CPUs while it converts.
+#ifdef __linux__
+	cpu_set_t saved;
+	int repin = affinityset && pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0
+		&& pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0;
+#endif
+	int len = ddsfs_convert(type, src, dst);
+	int err = errno;
+#ifdef __linux__
+	if (repin) pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+#endif
+
+	pthread_mutex_lock(&convertlock);
+	if (--foreground == 0) pthread_cond_broadcast(&foregrounddone);
+	pthread_mutex_unlock(&convertlock);
+	errno = err;
+	return len;
+}
@@ -13,7 +13,12 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 	
+#include "config.h"
+#if USE_FUSE3
+#define FUSE_USE_VERSION 35
+#else
 #define FUSE_USE_VERSION 26
+#endif
 #define _XOPEN_SOURCE 700
 #define _GNU_SOURCE
 
@@ -30,17 +35,24 @@
 #include <dirent.h>
 #include <errno.h>
 #include <pthread.h>
+#if USE_FUSE3
+#include <fuse_lowlevel.h>
+#else
 #include <fuse.h>
+#endif
 #include <atomic>
 #include <algorithm>
 #include <unordered_map>
 #include <list>
+#include <libdxt.h>
 #include "ddsfs.h"
 using namespace std;
 
 
 
+#if !USE_FUSE3
 struct fuse_operations oper;
+#endif
 struct Config config;
 enum {
 	KEY_HELP,
@@ -59,10 +71,52 @@ static struct fuse_opt ddsfs_opts[] = {
 	DDSFS_OPT("nocache",		cache, 0),
 	DDSFS_OPT("size",			size, 1),
 	DDSFS_OPT("nosize",			size, 0),
+	DDSFS_OPT("threads=%u",		threads, 0),
+	DDSFS_OPT("stream",			stream, 1),
+	DDSFS_OPT("nostream",		stream, 0),
+	DDSFS_OPT("mips=halve",		mipgen, MIPGEN_HALVE),
+	DDSFS_OPT("mips=dct",		mipgen, MIPGEN_DCT),
+	DDSFS_OPT("mips=dct8",		mipgen, MIPGEN_DCT8),
+	DDSFS_OPT("progressive",	progressive, 1),
+	DDSFS_OPT("noprogressive",	progressive, 0),
+	DDSFS_OPT("workers=%u",		workers, 0),
+	DDSFS_OPT("bgworkers=%u",	bgworkers, 0),
+	DDSFS_OPT("bgnice=%i",		bgnice, 0),
+	DDSFS_OPT("affinity=%s",	affinity, 0),
+	DDSFS_OPT("bgmem=%u",		bgmem, 0),
+	DDSFS_OPT("prefetch=%u",	prefetch, 0),
+	DDSFS_OPT("prefetchter",	prefetchter, 1),
+	DDSFS_OPT("noprefetchter",	prefetchter, 0),
+	DDSFS_OPT("learn",			learn, 1),
+	DDSFS_OPT("nolearn",		learn, 0),
+	DDSFS_OPT("learnmin=%u",	learnmin, 0),
+	DDSFS_OPT("listprobe",		listprobe, 1),
+	DDSFS_OPT("nolistprobe",	listprobe, 0),
+	DDSFS_OPT("listconvert=%u",	listconvert, 0),
+	DDSFS_OPT("index",			index, 1),
+	DDSFS_OPT("noindex",		index, 0),
+	DDSFS_OPT("negcache=%u",	negcache, 0),
+	DDSFS_OPT("dirindex",		dirindex, 1),
+	DDSFS_OPT("nodirindex",		dirindex, 0),
+	DDSFS_OPT("watch",			watch, 1),
+	DDSFS_OPT("nowatch",		watch, 0),
+	DDSFS_OPT("simd=auto",		simd, DXT_SIMD_AUTO),
+	DDSFS_OPT("simd=sse2",		simd, DXT_SIMD_SSE2),
+	DDSFS_OPT("simd=avx2",		simd, DXT_SIMD_AVX2),
+	DDSFS_OPT("simd=avx512",	simd, DXT_SIMD_AVX512),
+	DDSFS_OPT("pool=%u",		pool, 0),
+	DDSFS_OPT("hugepages",		hugepages, 1),
+	DDSFS_OPT("nohugepages",	hugepages, 0),
 	DDSFS_OPT("verbose",		debug, 1),
 	DDSFS_OPT("verbose=%i",		debug, 0),
 	DDSFS_OPT("--verbose",		debug, 1),
 	DDSFS_OPT("--verbose=%i",	debug, 0),
+#if USE_FUSE3
+	// FUSE 3 leaves these to the filesystem with its low-level API.
+	DDSFS_OPT("attr_timeout=%lf",	attr_timeout, 0),
+	DDSFS_OPT("entry_timeout=%lf",	entry_timeout, 0),
+	DDSFS_OPT("negative_timeout=%lf",	negative_timeout, 0),
+#endif
 	
 	FUSE_OPT_KEY("-h",			KEY_HELP),
 	FUSE_OPT_KEY("--help",		KEY_HELP),
@@ -92,10 +146,54 @@ static int ddsfs_opt_proc(void *data, const char *arg, int key, struct fuse_args
 			"    -o size                Calculate sizes for fake files. Slow, but some programs need it\n"
 			"    -o nosize              Give fake file sizes as the source file size (default)\n"
 			"    -o nocache             Equivalent to -o cache=0\n"
+			"    -o threads=#           Use # threads to encode each texture (default: number of CPUs)\n"
+			"    -o stream              Decode .jpg files a strip at a time instead of into one full-size buffer\n"
+			"    -o nostream            Decode .jpg files into a full-size buffer (default)\n"
+			"    -o mips=halve          Make each mip by averaging the one above it (default)\n"
+			"    -o mips=dct            Make .jpg mips 1-3 with scaled decodes, the rest by averaging\n"
+			"    -o mips=dct8           Make .jpg mip 3 with a 1/8-scale decode, the rest by averaging\n"
+			"    -o progressive         Return from open as soon as the size is known and convert in the background\n"
+			"    -o noprogressive       Finish converting before returning from open (default)\n"
+			"    -o workers=#           Run up to # progressive conversions at once (default: number of CPUs)\n"
+			"    -o bgworkers=#         Run up to # prefetch and idle-time conversions at once (default: 1)\n"
+			"    -o bgnice=#            Run prefetch and idle-time conversions at nice # instead of SCHED_IDLE\n"
+			"    -o affinity=<cpus>     Run conversions on the listed CPUs only, like 0-3,6\n"
+			"    -o bgmem=#             Queue up to # MB of prefetch and idle-time conversions (default: 256)\n"
+			"    -o prefetch=#          Convert photoscenery textures up to # tiles around each opened one (default: 0)\n"
+			"    -o prefetchter         Convert the textures named by each .ter file as it is opened\n"
+			"    -o noprefetchter       Leave textures until they are opened (default)\n"
+			"    -o learn               Learn which textures follow each other and convert them ahead of time, needs cachepath\n"
+			"    -o nolearn             Don't record the order of opens (default)\n"
+			"    -o learnmin=#          Convert ones which followed at least #%% of the time (default: 25)\n"
+			"    -o listprobe           Work out the sizes of converted files in the background when their directory is listed\n"
+			"    -o nolistprobe         Only work out sizes when a file is looked up (default)\n"
+			"    -o listconvert=#       Convert up to # files from each listed directory when idle (default: 0)\n"
+			"    -o index               Remember source file headers across mounts, so sizes don't need them read again, needs cachepath\n"
+			"    -o noindex             Read headers again after each mount (default)\n"
+			"    -o negcache=#          Remember files which don't exist for # seconds (default: 0)\n"
+			"    -o dirindex            Read the whole source path into memory at mount and answer lookups from it\n"
+			"    -o nodirindex          Look at the source path for every lookup (default)\n"
+			"    -o watch               Watch the source path for changes, and keep converted files in the page cache\n"
+			"    -o nowatch             Only notice changes through modification times (default)\n"
+			"    -o simd=auto           Use the widest DXT encoder and mip averaging the CPU supports (default)\n"
+			"    -o simd=sse2|avx2|avx512  Use at most the given instruction set\n"
+			"    -o pool=#              Keep up to # MB of freed conversion buffers for reuse (default: 256)\n"
+			"    -o hugepages           Ask for transparent huge pages for large conversion buffers\n"
+			"    -o nohugepages         Use normal pages for conversion buffers (default)\n"
 			"    -o verbose[=#]         Set level of information on DDSFS's operations\n"
 			"\n", outargs->argv[0]);
+#if USE_FUSE3
+		fprintf(stderr,
+			"FUSE options:\n"
+			"    -o attr_timeout=#      Let the kernel keep file attributes for # seconds (default: 1)\n"
+			"    -o entry_timeout=#     Let the kernel keep names for # seconds (default: 1)\n"
+			"    -o negative_timeout=#  Let the kernel remember missing names for # seconds (default: -o negcache)\n");
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+#else
 		fuse_opt_add_arg(outargs, "-ho");
 		fuse_main(outargs->argc, outargs->argv, &oper, NULL);
+#endif
 		exit(1);
 	 case FUSE_OPT_KEY_NONOPT:
 		if (config.basepath == NULL) {
@@ -120,22 +218,126 @@ static void mkpath(const char* path) {
 	}
 }
 
-static int ddsfs_getattr(const char *path, struct stat *stbuf)
+// Reads just enough of srcpath to know how big its converted file will be,
+// and remembers it as the size of name. With -o index, files read before
+// aren't read again until they change. Lookups of a file while this is going
+// on wait for the one read. Returns the size, or -errno.
+int ddsfs_probe(int type, const char* srcpath, const char* name) {
+	struct stat st;
+	SourceInfo info;
+	int indexed = config.index && stat(srcpath, &st) == 0;
+	if (indexed && srcindex_get(srcpath, &st, &info) == 0) {
+		sizecache_set(name, info.size);
+		return info.size;
+	}
+	
+	Flight* flight = inflight_begin(FLIGHT_SIZE, srcpath);
+	if (flight) return inflight_wait(flight);
+	
+	int width = 0, height = 0, alpha = 0;
+	int size = 0;
+	int res = -1;
+	errno = ENOENT;
+	switch (type) {
+	#if USE_JPG
+	case SRC_JPG:
+		res = ddsfs_jpg_header(srcpath, &width, &height);
+		if (res == 0) size = dds_size(width, height);
+		break;
+	#endif
+	#if USE_WEBP
+	case SRC_WEBP:
+		res = ddsfs_webp_header(srcpath, &width, &height, &alpha);
+		if (res == 0) size = dds_size(width, height, alpha);
+		break;
+	#endif
+	#if USE_GZIP
+	case SRC_GZIP:
+		res = ddsfs_gzip_header(srcpath, &size);
+		break;
+	#endif
+	#if USE_XZ
+	case SRC_XZ:
+		res = ddsfs_xz_header(srcpath, &size);
+		break;
+	#endif
+	}
+	
+	if (res == 0) {
+		sizecache_set(name, size);
+		if (indexed) {
+			info.width = width;
+			info.height = height;
+			info.alpha = alpha;
+			info.format = (width == 0 || !config.compress) ? 0 : alpha == ALPHA_FULL ? FORMAT_DXT5 : alpha == ALPHA_BINARY ? FORMAT_DXT1A : FORMAT_DXT1;
+			info.size = size;
+			srcindex_set(srcpath, &st, &info);
+		}
+	} else size = errno ? -errno : -EIO;
+	inflight_end(FLIGHT_SIZE, srcpath, size, 0);
+	return size;
+}
+
+// Gives a converted file's stbuf its size, if it's known or -o size is set.
+static int ddsfs_sized(int type, const char* srcpath, const char* origpath, struct stat *stbuf)
+{
+	int size = sizecache_get(origpath);
+	if (size != -1) {
+		stbuf->st_size = size;
+	} else if (config.size) {
+		size = ddsfs_probe(type, srcpath, origpath);
+		if (size < 0) return size;
+		stbuf->st_size = size;
+	}
+	return 0;
+}
+
+// Sets srcpath to the file of the given type that rwpath is converted from.
+static void ddsfs_srcpath(int type, const char* rwpath, char* srcpath)
+{
+	strcpy(srcpath, rwpath);
+	if (type == SRC_JPG) strcpy(strrchr(srcpath, '.'), ".jpg");
+	else if (type == SRC_WEBP) strcpy(strrchr(srcpath, '.'), ".webp");
+	else strcat(srcpath, type == SRC_GZIP ? ".gz" : ".xz");
+}
+
+// Works out what path is. The source path is looked at through atfd and
+// name, which are either the descriptor of path's directory and the last part
+// of path, or AT_FDCWD and rwpath. type is set to -1 for real files, or the
+// SRC_ type of the file it's converted from, with srcpath set to that file.
+// srcpath needs room for rwpath plus the longest source extension.
+int ddsfs_lookup(const char* path, const char* rwpath, int atfd, const char* name, struct stat *stbuf, int* type, char* srcpath)
 {
 	int res;
-	char origpath[config.basepathlen+strlen(path)+1];
-	char rwpath[config.basepathlen+strlen(path)+8];
+	char test[strlen(name)+8];
 	char* ext;
 
-	strcpy(origpath, config.basepath);
-	strcat(origpath, path);
-	strcpy(rwpath, origpath);
 	if (DEBUG >= 3) printf("getattr: %s\n", rwpath);
 
-	res = lstat(rwpath, stbuf);
+	res = dirindex_find(path, type);
+	if (res <= 0 && (res < 0 || *type != -1)) {
+		// Files in cachepath aren't indexed, and come first like below.
+		if (config.cachepath) {
+			char cpath[config.cachepathlen+strlen(path)+1];
+			sprintf(cpath, "%s%s", config.cachepath, path);
+			if (lstat(cpath, stbuf) == 0) {
+				*type = -1;
+				return 0;
+			}
+		}
+		if (res < 0) return res;
+		ddsfs_srcpath(*type, rwpath, srcpath);
+		// The source's name, relative to atfd like name is.
+		if (fstatat(atfd, srcpath + strlen(rwpath) - strlen(name), stbuf, AT_SYMLINK_NOFOLLOW) == -1) return -errno;
+		return ddsfs_sized(*type, srcpath, rwpath, stbuf);
+	}
+	*type = -1;
+
+	res = fstatat(atfd, name, stbuf, AT_SYMLINK_NOFOLLOW);
 	if (res == -1) {
 		if (DEBUG >= 3) printf("getattr: lstat failed on '%s', looking for alternates.\n", rwpath);
-		ext = strrchr(rwpath, '.');
+		strcpy(test, name);
+		ext = strrchr(test, '.');
 		if (!ext) return -errno;
 		
 		if (config.cachepath) {
@@ -150,123 +352,101 @@ static int ddsfs_getattr(const char *path, struct stat *stbuf)
 		if (!strcasecmp(ext, ".dds")) {
 			#if USE_JPG
 			strcpy(ext, ".jpg");
-			res = lstat(rwpath, stbuf);
-			if (res == 0) {
-				int size = sizecache_get(origpath);
-				if (size != -1) {
-					stbuf->st_size = size;
-				} else if (config.size) {
-					int width, height;
-					res = ddsfs_jpg_header(rwpath, &width, &height);
-					if (res != 0) return -errno;
-					
-					stbuf->st_size = dds_size(width, height);
-					sizecache_set(rwpath, stbuf->st_size);
-				}
-				return 0;
-			}
+			res = fstatat(atfd, test, stbuf, AT_SYMLINK_NOFOLLOW);
+			if (res == 0) *type = SRC_JPG;
 			#endif
 			
 			#if USE_WEBP
-			strcpy(ext, ".webp");
-			res = lstat(rwpath, stbuf);
-			if (res == 0) {
-				int size = sizecache_get(origpath);
-				if (size != -1) {
-					stbuf->st_size = size;
-				} else if (config.size) {
-					int width, height, alpha;
-					res = ddsfs_webp_header(rwpath, &width, &height, &alpha);
-					if (res != 0) return -errno;
-					
-					stbuf->st_size = dds_size(width, height, alpha);
-					sizecache_set(rwpath, stbuf->st_size);
-				}
-				return 0;
+			if (*type == -1) {
+				strcpy(ext, ".webp");
+				res = fstatat(atfd, test, stbuf, AT_SYMLINK_NOFOLLOW);
+				if (res == 0) *type = SRC_WEBP;
 			}
 			#endif
-			
-			return -errno;
 		} else {
 			ext += strlen(ext);
 
 			#if USE_GZIP
 			strcpy(ext, ".gz");
-			res = lstat(rwpath, stbuf);
-			if (res == 0) {
-				int size = sizecache_get(origpath);
-				if (size != -1) {
-					stbuf->st_size = size;
-				} else if (config.size) {
-					int width, height, alpha;
-					res = ddsfs_gzip_header(rwpath, &size);
-					if (res != 0) return -errno;
-					
-					stbuf->st_size = size;
-					sizecache_set(rwpath, stbuf->st_size);
-				}
-				return 0;				
-			}
+			res = fstatat(atfd, test, stbuf, AT_SYMLINK_NOFOLLOW);
+			if (res == 0) *type = SRC_GZIP;
 			#endif
 			
 			#if USE_XZ
-			strcpy(ext, ".xz");
-			res = lstat(rwpath, stbuf);
-			if (res == 0) {
-				int size = sizecache_get(origpath);
-				if (size != -1) {
-					stbuf->st_size = size;
-				} else if (config.size) {
-					int width, height, alpha;
-					res = ddsfs_xz_header(rwpath, &size);
-					if (res != 0) return -errno;
-					
-					stbuf->st_size = size;
-					sizecache_set(rwpath, stbuf->st_size);
-				}
-				return 0;				
+			if (*type == -1) {
+				strcpy(ext, ".xz");
+				res = fstatat(atfd, test, stbuf, AT_SYMLINK_NOFOLLOW);
+				if (res == 0) *type = SRC_XZ;
 			}
 			#endif
-			
-			return -errno;
 		}
+		if (*type == -1) return -errno;
+		
+		ddsfs_srcpath(*type, rwpath, srcpath);
+		return ddsfs_sized(*type, srcpath, rwpath, stbuf);
 	}
 
 	return 0;
 }
 
-static int ddsfs_access(const char *path, int mask)
-{
-	char rwpath[config.basepathlen+strlen(path)+1];
-	int res;
-
-	sprintf(rwpath, "%s%s", config.basepath, path);
-	res = access(rwpath, mask);
-	if (res == -1)
-		return -errno;
+struct IndexListing {
+	int (*add)(void* arg, const char* name, const struct stat* st);
+	void* arg;
+	const string* dir;
+	list<string>* listed;
+};
 
-	return 0;
+static int ddsfs_readdir_indexed(void* arg, const char* name, const struct stat* st, int type)
+{
+	IndexListing* l = (IndexListing*)arg;
+	if (type == -1) return l->add(l->arg, name, st);
+	
+	struct stat vst = *st;
+	string rwname = config.basepath + *l->dir + name;
+	int size = sizecache_get(rwname.c_str());
+	if (size != -1) vst.st_size = size;
+	if (l->listed) l->listed->push_back(*l->dir + name);
+	return l->add(l->arg, name, &vst);
 }
 
-static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+// Lists the directory at path, with the files converted from those in it.
+// atfd is its descriptor, or AT_FDCWD to open rwpath. add is called for each
+// entry, and returns nonzero to stop. Returns 0 or -errno.
+int ddsfs_list(const char* path, const char* rwpath, int atfd, int (*add)(void* arg, const char* name, const struct stat* st), void* arg)
 {
 	DIR *dp;
 	struct dirent *de;
-	char rwpath[strlen(config.basepath)+strlen(path)+1];
 	char* rwname = (char*)malloc(1024);
 	unsigned int rwnamelen = 1024;
 	char* testpath = (char*)malloc(1024);
 	unsigned int testpathlen = 1024;
 	char* ext;
-
-	(void) fi;
-	
-	sprintf(rwpath, "%s%s", config.basepath, path);
-	
-	if (DEBUG) printf("readdir: path=%s offset=%ld\n", rwpath, offset);
-	dp = opendir(rwpath);
-	if (dp == NULL) return -errno;
+	// Converted files listed here, for -o listprobe and -o listconvert.
+	int listing = config.listprobe || config.listconvert;
+	list<string> listed;
+	string dir = path;
+	if (dir.empty() || dir.back() != '/') dir += '/';
+
+	if (DEBUG) printf("readdir: path=%s\n", rwpath);
+	IndexListing indexed = { add, arg, &dir, listing ? &listed : NULL };
+	if (dirindex_list(path, ddsfs_readdir_indexed, &indexed) == 0) {
+		add(arg, ".", NULL);
+		add(arg, "..", NULL);
+		free(rwname);
+		free(testpath);
+		if (listing && !listed.empty()) prefetch_listed(listed);
+		if (DEBUG >= 2) printf("readdir: Answered from index.\n");
+		return 0;
+	}
+	int fd = openat(atfd, atfd == AT_FDCWD ? rwpath : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dp = fd == -1 ? NULL : fdopendir(fd);
+	if (dp == NULL) {
+		int err = errno;
+		if (fd != -1) close(fd);
+		free(rwname);
+		free(testpath);
+		return -err;
+	}
 
 	struct stat st;
 	while ((de = readdir(dp))) {
@@ -275,7 +455,7 @@ static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		
 		st.st_ino = de->d_ino;
 		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
+		if (add(arg, de->d_name, &st))
 			break;
 		
 		if (strlen(de->d_name) >= rwnamelen) {
@@ -299,10 +479,11 @@ static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 			strcpy(ext, ".dds");
 			sprintf(testpath, "%s/%s", rwpath, rwname);
-			if (stat(testpath, &st) == -1) {
+			if (fstatat(dirfd(dp), rwname, &st, 0) == -1) {
 				int size = sizecache_get(testpath);
 				if (size != -1) st.st_size = size;
-				filler(buf, rwname, &st, 0);
+				if (add(arg, rwname, &st)) break;
+				if (listing) listed.push_back(dir + rwname);
 				if (DEBUG >= 3) printf("\t\tAdded .dds\n");
 			} else {
 				if (DEBUG >= 3) printf("\t\tSkipped .dds\n");
@@ -320,10 +501,11 @@ static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 			strcpy(ext, ".dds");
 			sprintf(testpath, "%s/%s", rwpath, rwname);
-			if (stat(testpath, &st) == -1) {
+			if (fstatat(dirfd(dp), rwname, &st, 0) == -1) {
 				int size = sizecache_get(testpath);
 				if (size != -1) st.st_size = size;
-				filler(buf, rwname, &st, 0);
+				if (add(arg, rwname, &st)) break;
+				if (listing) listed.push_back(dir + rwname);
 				if (DEBUG >= 3) printf("\t\tAdded .dds\n");
 			} else {
 				if (DEBUG >= 3) printf("\t\tSkipped .dds\n");
@@ -341,10 +523,11 @@ static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 			*ext = 0;
 			sprintf(testpath, "%s/%s", rwpath, rwname);
-			if (stat(testpath, &st) == -1) {
+			if (fstatat(dirfd(dp), rwname, &st, 0) == -1) {
 				int size = sizecache_get(testpath);
 				if (size != -1) st.st_size = size;
-				filler(buf, rwname, &st, 0);
+				if (add(arg, rwname, &st)) break;
+				if (listing) listed.push_back(dir + rwname);
 				if (DEBUG >= 3) printf("\t\tAdded .gz\n");
 			} else {
 				if (DEBUG >= 3) printf("\t\tSkipped .gz\n");
@@ -362,10 +545,11 @@ static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 			*ext = 0;
 			sprintf(testpath, "%s/%s", rwpath, rwname);
-			if (stat(testpath, &st) == -1) {
+			if (fstatat(dirfd(dp), rwname, &st, 0) == -1) {
 				int size = sizecache_get(testpath);
 				if (size != -1) st.st_size = size;
-				filler(buf, rwname, &st, 0);
+				if (add(arg, rwname, &st)) break;
+				if (listing) listed.push_back(dir + rwname);
 				if (DEBUG >= 3) printf("\t\tAdded .xz\n");
 			} else {
 				if (DEBUG >= 3) printf("\t\tSkipped .xz\n");
@@ -377,152 +561,264 @@ static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	closedir(dp);
 	free(rwname);
 	free(testpath);
+	if (listing && !listed.empty()) prefetch_listed(listed);
 	if (DEBUG >= 2) printf("readdir: Done.\n");
 	return 0;
 }
 
-static int ddsfs_open(const char *path, struct fuse_file_info *fi)
+// Finds the file rwpath would be converted from. srcpath needs room for
+// rwpath plus the longest source extension.
+int ddsfs_source(const char* rwpath, char* srcpath) {
+	struct stat st;
+	char* ext;
+	
+	#if USE_JPG
+	strcpy(srcpath, rwpath);
+	ext = strrchr(srcpath, '.');
+	strcpy(ext, ".jpg");
+	if (stat(srcpath, &st) == 0) return SRC_JPG;
+	#endif
+	
+	#if USE_WEBP
+	strcpy(srcpath, rwpath);
+	ext = strrchr(srcpath, '.');
+	strcpy(ext, ".webp");
+	if (stat(srcpath, &st) == 0) return SRC_WEBP;
+	#endif
+	
+	#if USE_GZIP
+	strcpy(srcpath, rwpath);
+	ext = srcpath + strlen(srcpath);
+	strcpy(ext, ".gz");
+	if (stat(srcpath, &st) == 0) return SRC_GZIP;
+	#endif
+	
+	#if USE_XZ
+	strcpy(srcpath, rwpath);
+	ext = srcpath + strlen(srcpath);
+	strcpy(ext, ".xz");
+	if (stat(srcpath, &st) == 0) return SRC_XZ;
+	#endif
+	
+	return -1;
+}
+
+// Numbers temporary files, so two writes of the same file at once don't truncate each other's.
+static std::atomic<unsigned int> cachewrites(0);
+
+// Writes a converted file for cache=1, and returns a descriptor for it rewound
+// to the start. It's written under a temporary name and renamed into place, so
+// nobody can open it half-written.
+int cache_write(const char* path, const char* rwpath, unsigned char* dds, int len) {
+	char cpath[(config.cachepath ? config.cachepathlen : 0)+strlen(path)+1];
+	const char* file = rwpath;
+	if (config.cachepath) {
+		sprintf(cpath, "%s%s", config.cachepath, path);
+		mkpath(cpath);
+		file = cpath;
+	}
+	char tmppath[strlen(file)+16];
+	sprintf(tmppath, "%s.%u.tmp", file, cachewrites++);
+	watch_written(file);
+	
+	if (DEBUG >= 2) printf("cache: Writing %d bytes to '%s'\n", len, file);
+	int fd = open(tmppath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "cache: Could not open '%s' for write.\n", tmppath);
+		return -1;
+	}
+	
+	len = write(fd, dds, len);
+	if (DEBUG >= 2) printf("cache: Wrote %d bytes.\n", len);
+	if (rename(tmppath, file) == -1) {
+		int err = errno;
+		fprintf(stderr, "cache: Could not rename '%s' to '%s'.\n", tmppath, file);
+		close(fd);
+		unlink(tmppath);
+		errno = err;
+		return -1;
+	}
+	
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+// Looks for a finished conversion of path, in memory or on disk. Returns a handle, or -1.
+static int ddsfs_cached(const char* path, const char* rwpath, int flags) {
+	int fd;
+	if (config.cache != CACHE_DISK || config.progressive) {
+		fd = memcache_getfd(rwpath);
+		if (fd > 0) {
+			if (DEBUG) printf("\tmemcache: Using FD %d for existing reference.\n", fd);
+			return fd;
+		}
+	}
+	
+	if (config.cachepath) {
+		char cpath[config.cachepathlen+strlen(path)+1];
+		sprintf(cpath, "%s%s", config.cachepath, path);
+		fd = open(cpath, flags);
+		if (fd != -1) {
+			if (DEBUG) printf("\tFound file in cachepath: %s\n", cpath);
+			return fd;
+		}
+	} else if (config.cache == CACHE_DISK) {
+		fd = open(rwpath, flags);
+		if (fd != -1) return fd;
+	}
+	return -1;
+}
+
+// Opens path, converting it first if it's made from another file. The source
+// path is looked at through atfd and name like ddsfs_lookup. type and srcpath
+// are what a lookup found, or -1 to look again. Returns a descriptor or a
+// memcache handle, or -errno.
+int ddsfs_openfile(const char* path, const char* rwpath, int atfd, const char* name, int flags, int type, const char* srcpath)
 {
 	int res;
-	char rwpath[config.basepathlen+strlen(path)+1];
 	char* ext;
-	struct stat st;
-	
-	sprintf(rwpath, "%s%s", config.basepath, path);
 	
 	if (DEBUG) printf("open: %s\n", rwpath);
-	res = open(rwpath, fi->flags);
+	res = openat(atfd, name, flags);
 	if (res == -1) {
-		ext = strrchr(rwpath, '.');
+		ext = strrchr((char*)rwpath, '.');
 		if (!ext) return -errno;
 		
 		if (DEBUG) printf("\tOpening file which does not exist.\n");
-		char srcpath[strlen(rwpath)+8];
+		char src[strlen(rwpath)+8];
 		unsigned char* dds = NULL;
 		int len = 0;
 		
-		if (config.cache != CACHE_DISK) {
-			res = memcache_getfd(rwpath);
-			if (res > 0) {
-				if (DEBUG) printf("\tmemcache: Using FD %d for existing reference.\n", res);
-				fi->fh = res;
-				return 0;
-			}
+		res = ddsfs_cached(path, rwpath, flags);
+		if (res > 0) {
+			prefetch_opened(path);
+			return res;
 		}
 		
-		if (config.cachepath) {
-			char cpath[config.cachepathlen+strlen(path)+1];
-			sprintf(cpath, "%s%s", config.cachepath, path);
-			res = open(cpath, fi->flags);
-			if (res != -1) {
-				if (DEBUG) printf("\tFound file in cachepath: %s\n", cpath);
-				fi->fh = res;
-				return 0;
-			}
-		}
+		if (type == -1) type = ddsfs_source(rwpath, src);
+		else strcpy(src, srcpath);
+		if (type == -1) return -ENOENT;
 		
-		#if USE_JPG
-		strcpy(srcpath, rwpath);
-		ext = strrchr(srcpath, '.');
-		strcpy(ext, ".jpg");
-		res = stat(srcpath, &st);
-		if (res == 0) {
-			if (config.compress) len = ddsfs_jpg_dxt1(srcpath, &dds);
-			else len = ddsfs_jpg_rgb(srcpath, &dds);
-			if (len == -1) return -errno;
+		// Only one open converts a file at a time, any others get a handle to its result.
+		Flight* flight = inflight_begin(FLIGHT_OPEN, rwpath);
+		if (flight) {
+			res = inflight_wait(flight);
+			if (res < 0) return res;
+			if (DEBUG) printf("\tinflight: Using FD %d from another open of '%s'\n", res, rwpath);
+			return res;
 		}
-		#endif
 		
-		#if USE_WEBP
-		if (!dds) {
-			strcpy(srcpath, rwpath);
-			ext = strrchr(srcpath, '.');
-			strcpy(ext, ".webp");
-			res = stat(srcpath, &st);
-			if (res == 0) {
-				if (config.compress) len = ddsfs_webp_dxt1(srcpath, &dds);
-				else len = ddsfs_webp_rgb(srcpath, &dds);
-				if (len == -1) return -errno;
-			}
+		// It may have finished between the lookup above and joining the table.
+		res = ddsfs_cached(path, rwpath, flags);
+		if (res > 0) {
+			inflight_end(FLIGHT_OPEN, rwpath, res, 1);
+			return res;
 		}
-		#endif
 		
-		#if USE_GZIP
-		if (!dds) {
-			strcpy(srcpath, rwpath);
-			ext = srcpath + strlen(srcpath);
-			strcpy(ext, ".gz");
-			res = stat(srcpath, &st);
-			if (res == 0) {
-				len = ddsfs_gzip(srcpath, &dds);
-				if (len == -1) return -errno;
-			}
+		if (config.progressive) {
+			res = convert_open(path, rwpath, src, type);
+			inflight_end(FLIGHT_OPEN, rwpath, res, 1);
+			if (res < 0) return res;
+			if (DEBUG) printf("\tconvert: Using FD %d while converting '%s'\n", res, src);
+			prefetch_opened(path);
+			return res;
 		}
-		#endif
 		
-		#if USE_XZ
-		if (!dds) {
-			strcpy(srcpath, rwpath);
-			ext = srcpath + strlen(srcpath);
-			strcpy(ext, ".xz");
-			res = stat(srcpath, &st);
-			if (res == 0) {
-				len = ddsfs_xz(srcpath, &dds);
-				if (len == -1) return -errno;
-			}
+		len = convert_now(rwpath, type, src, &dds);
+		if (len == -1) {
+			res = -errno;
+			inflight_end(FLIGHT_OPEN, rwpath, res, 0);
+			return res;
 		}
-		#endif
 		
-		// Failed to decode another file, bail out.
-		if (!dds) return -ENOENT;
-
+		int fd;
 		if (config.cache == CACHE_DISK) {
-			int fd;
-			if (config.cachepath) {
-				char cpath[config.cachepathlen+strlen(path)+1];
-				sprintf(cpath, "%s%s", config.cachepath, path);
-				if (DEBUG >= 2) printf("cache: Writing %d bytes to '%s'\n", len, cpath);
-				mkpath(cpath);
-				fd = open(cpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
-				if (fd == -1) {
-					fprintf(stderr, "cache: Could not open '%s' for write.\n", cpath);
-					free(dds);
-					return -errno;
-				}
-			} else {
-				if (DEBUG >= 2) printf("cache: Writing %d bytes to '%s'\n", len, rwpath);
-				fd = open(rwpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
-				if (fd == -1) {
-					fprintf(stderr, "cache: Could not open '%s' for write.\n", rwpath);
-					free(dds);
-					return -errno;
-				}
-			}
-			
-			len = write(fd, dds, len);
-			free(dds);
-			if (DEBUG >= 2) printf("cache: Wrote %d bytes.\n", len);
-			
-			lseek(fd, 0, SEEK_SET);
-			fi->fh = fd;
-			return 0;
+			fd = cache_write(path, rwpath, dds, len);
+			if (fd == -1) fd = -errno;
+			bufpool_put(dds);
 		} else {
-			int fd = memcache_getfd(rwpath);
-			if (fd > 0) {
-				if (DEBUG) printf("memcache: Recheck found FD %d for existing reference.\n", fd);
-				free(dds);
-			} else {
-				sizecache_set(rwpath, len);
-				
-				fd = memcache_store(rwpath, dds, len);
-				
-				if (DEBUG) printf("memcache: Using FD %d for %d bytes: '%s'\n", fd, len, rwpath);
-			}
-			fi->fh = fd;
-			return 0;
+			sizecache_set(rwpath, len);
+			fd = memcache_store(rwpath, dds, len);
+			if (DEBUG) printf("memcache: Using FD %d for %d bytes: '%s'\n", fd, len, rwpath);
 		}
+		inflight_end(FLIGHT_OPEN, rwpath, fd, 1);
+		if (fd < 0) return fd;
+		
+		prefetch_opened(path);
+		return fd;
 	}
 
+	ext = strrchr((char*)rwpath, '.');
+	if (ext && !strcasecmp(ext, ".ter")) prefetch_ter(path);
+	return res;
+}
+
+// Closes a handle from ddsfs_openfile.
+int ddsfs_close(int fd)
+{
+	if (fd == 0) return 0;
+	if (fd >= MEMCACHE_FDBASE && memcache_release(fd)) return 0;
+	return close(fd);
+}
+
+#if !USE_FUSE3
+static int ddsfs_getattr(const char *path, struct stat *stbuf)
+{
+	char rwpath[config.basepathlen+strlen(path)+1];
+	sprintf(rwpath, "%s%s", config.basepath, path);
+	if (negcache_has(rwpath)) return -ENOENT;
+	
+	int type;
+	char srcpath[sizeof(rwpath)+8];
+	int res = ddsfs_lookup(path, rwpath, AT_FDCWD, rwpath, stbuf, &type, srcpath);
+	if (res == -ENOENT) negcache_add(rwpath);
+	return res;
+}
+
+static int ddsfs_access(const char *path, int mask)
+{
+	char rwpath[config.basepathlen+strlen(path)+1];
+	int res;
+
+	sprintf(rwpath, "%s%s", config.basepath, path);
+	res = access(rwpath, mask);
+	if (res == -1)
+		return -errno;
+
+	return 0;
+}
+
+struct FillListing {
+	void* buf;
+	fuse_fill_dir_t filler;
+};
+
+static int ddsfs_readdir_fill(void* arg, const char* name, const struct stat* st)
+{
+	FillListing* l = (FillListing*)arg;
+	return l->filler(l->buf, name, st, 0);
+}
+
+static int ddsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	char rwpath[config.basepathlen+strlen(path)+1];
+	FillListing fill = { buf, filler };
+
+	(void) offset;
+	(void) fi;
+	
+	sprintf(rwpath, "%s%s", config.basepath, path);
+	return ddsfs_list(path, rwpath, AT_FDCWD, ddsfs_readdir_fill, &fill);
+}
+
+static int ddsfs_open(const char *path, struct fuse_file_info *fi)
+{
+	char rwpath[config.basepathlen+strlen(path)+1];
+	sprintf(rwpath, "%s%s", config.basepath, path);
+	
+	int res = ddsfs_openfile(path, rwpath, AT_FDCWD, rwpath, fi->flags, -1, NULL);
+	if (res < 0) return res;
 	fi->fh = res;
 	return 0;
 }
@@ -539,10 +835,7 @@ static int ddsfs_read(const char *path, char *buf, size_t size, off_t offset, st
 		if (DEBUG) printf("read: Called with no info for file '%s'\n", path);
 	} else {
 		fd = fi->fh;
-		if (config.cache != CACHE_DISK) {
-			int ret = memcache_read(fd, buf, size, offset);
-			if (ret >= 0) return ret;
-		}
+		if (fi->fh >= MEMCACHE_FDBASE) return memcache_read(fd, buf, size, offset);
 	}
 	if (fd == -1) return -errno;
 
@@ -554,13 +847,25 @@ static int ddsfs_read(const char *path, char *buf, size_t size, off_t offset, st
 	return res;
 }
 
+static void* ddsfs_init(struct fuse_conn_info *conn)
+{
+	dirindex_start();
+	watch_start();
+	return NULL;
+}
+
+static void ddsfs_destroy(void* data)
+{
+	prefetch_save();
+}
+
 static int ddsfs_release(const char *path, struct fuse_file_info *fi)
 {
 	if (DEBUG >= 2) printf("release: %s\n", path);
-	if (fi == NULL || fi->fh == 0) return 0;
-	if (config.cache != CACHE_DISK && memcache_release(fi->fh)) return 0;
-	return close(fi->fh);
+	if (fi == NULL) return 0;
+	return ddsfs_close(fi->fh);
 }
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -571,6 +876,7 @@ int main(int argc, char *argv[])
 	
 	memcache_init();
 
+#if !USE_FUSE3
 	memset(&oper, 0, sizeof(oper));
 	oper.getattr = ddsfs_getattr;
 	oper.access = ddsfs_access;
@@ -578,8 +884,20 @@ int main(int argc, char *argv[])
 	oper.open = ddsfs_open;
 	oper.read = ddsfs_read;
 	oper.release = ddsfs_release;
+	oper.init = ddsfs_init;
+	oper.destroy = ddsfs_destroy;
+#endif
 
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	config.pool = 256;
+	config.bgworkers = 1;
+	config.bgmem = 256;
+	config.learnmin = 25;
+#if USE_FUSE3
+	config.attr_timeout = 1.0;
+	config.entry_timeout = 1.0;
+	config.negative_timeout = -1;
+#endif
 	fuse_opt_parse(&args, &config, ddsfs_opts, ddsfs_opt_proc);
 	
 	if (config.basepath == NULL) {
@@ -589,9 +907,42 @@ int main(int argc, char *argv[])
 	
 	config.basepathlen = strlen(config.basepath);
 	if (config.cachepath) config.cachepathlen = strlen(config.cachepath);
+	if (config.threads == 0) config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (config.workers == 0) config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+#if USE_FUSE3
+	// Let the kernel remember misses for as long as -o negcache, unless told otherwise.
+	if (config.negative_timeout < 0) config.negative_timeout = config.negcache;
+#else
+	if (config.watch) {
+		// Changes are noticed now, so the kernel can keep file contents until their size or time changes.
+		fuse_opt_add_arg(&args, "-oauto_cache");
+	}
+	if (config.negcache) {
+		// Let the kernel remember misses for as long too, unless told otherwise.
+		int given = 0;
+		for (int i = 0; i < args.argc; i++) {
+			if (strstr(args.argv[i], "negative_timeout=")) given = 1;
+		}
+		if (!given) {
+			char opt[64];
+			sprintf(opt, "-onegative_timeout=%u", config.negcache);
+			fuse_opt_add_arg(&args, opt);
+		}
+	}
+#endif
+	convert_init();
+	prefetch_init();
+	srcindex_init();
+	int simd = config.simd;
+	config.simd = DXTSetSIMD(simd);
+	if (DEBUG) printf("DXT: Using %s kernels, %s requested.\n", DXTSIMDName(config.simd), DXTSIMDName(simd));
 	
-	printf("Starting: basepath=%s cache=%d format=%s\n", config.basepath, config.cache, config.compress?"DXT":"RGB");
+	printf("Starting: basepath=%s cache=%d format=%s threads=%u\n", config.basepath, config.cache, config.compress?"DXT":"RGB", config.threads);
+#if USE_FUSE3
+	int ret = lowlevel_main(&args);
+#else
 	int ret = fuse_main(args.argc, args.argv, &oper, NULL);
+#endif
 	printf("Exiting.\n");
 	
 	return ret;
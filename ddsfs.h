@@ -8,24 +8,84 @@
 #endif
 
 #define MINSIZE 16
+#define STRIPROWS 16
+// Memory-cached files get handles from here up, so they can't be confused with real descriptors.
+#define MEMCACHE_FDBASE 0x40000000
 
+#include <stdint.h>
+#include <time.h>
 #include <unordered_map>
 #include <string>
+#include <list>
 
 enum {
 	CACHE_NONE,
 	CACHE_DISK,
 	CACHE_MEM,
 };
+enum {
+	SRC_JPG,
+	SRC_WEBP,
+	SRC_GZIP,
+	SRC_XZ,
+};
+enum {
+	ALPHA_NONE,
+	ALPHA_BINARY,
+	ALPHA_FULL,
+};
+// Conversion job classes, most urgent first.
+enum {
+	CONVERT_OPEN,
+	CONVERT_PREFETCH,
+	CONVERT_IDLE,
+	CONVERT_CLASSES,
+};
+enum {
+	FLIGHT_OPEN,
+	FLIGHT_SIZE,
+};
+enum {
+	MIPGEN_HALVE,
+	MIPGEN_DCT,
+	MIPGEN_DCT8,
+};
 extern struct Config {
 	char* basepath;
 	char* cachepath;
+	char* affinity;
 	unsigned short basepathlen;
 	unsigned short cachepathlen;
 	unsigned int cache;
+	unsigned int threads;
+	int stream;
+	int mipgen;
+	int progressive;
+	unsigned int workers;
+	unsigned int bgworkers;
+	int bgnice;
+	unsigned int bgmem;
+	unsigned int prefetch;
+	int prefetchter;
+	int learn;
+	unsigned int learnmin;
+	int listprobe;
+	unsigned int listconvert;
+	int index;
+	unsigned int negcache;
+	int dirindex;
+	int watch;
+	int simd;
+	unsigned int pool;
+	int hugepages;
 	char compress;
 	char debug;
 	char size;
+#if USE_FUSE3
+	double attr_timeout;
+	double entry_timeout;
+	double negative_timeout;
+#endif
 	// ASan reports fuse option parsing going off the end of the array, and I can't be bothered fixing fuse.
 	char deadspace[32];
 } config;
@@ -63,18 +123,131 @@ extern inline int poweroftwo(unsigned int x) {
   return !(x & (x - 1));
 }
 
+// FNV-1a of len bytes of name, never 0 so that can mark empty slots.
+extern inline uint64_t fnv1a(const char* name, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+	return h ? h : 1;
+}
+
+extern inline int64_t monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Directories are only stat'd again this often to see if they changed, in nanoseconds.
+#define DIRCHECK 1000000000LL
+
+// Images handed to the DXT encoder have their rows and columns padded to a multiple of 4.
+#define PADDED(x) (((x) + 3) & ~3)
+
+void* bufpool_get(size_t size);
+void bufpool_put(void* buf);
+
 void halveimage(const unsigned char* src, int width, int height, unsigned char* dst);
+void shrinkimage(const unsigned char* src, int width, int height, unsigned char* dst);
+void padimage(unsigned char* img, int width, int height);
+
+// Encodes a power-of-two image into DXT mips as its rows arrive top to bottom.
+class MipStream {
+public:
+	MipStream(int width, int height, int mips, int alpha, unsigned char* dst);
+	~MipStream();
+	unsigned char* rows();
+	int space();
+	void commit(int rows);
+private:
+	struct Level {
+		int width, height;
+		int size, rows;
+		unsigned char* strip;
+		unsigned char* out;
+	};
+	Level* levels;
+	unsigned char* base;
+	int count;
+	int format;
+	void flush(int level);
+};
 
+int dds_mips(int width, int height);
+int dds_dxtsize(int width, int height, int alpha);
 int dds_size(int width, int height, int alpha=0);
 int sizecache_get(const char* name);
 void sizecache_set(const char* name, int size);
+void sizecache_forget(const char* name);
+
+// What a source file's header says about the file made from it.
+struct SourceInfo {
+	int width, height;	// 0 for .gz and .xz files.
+	int alpha;
+	int format;
+	int size;
+};
+void srcindex_init();
+int srcindex_get(const char* src, const struct stat* st, SourceInfo* info);
+void srcindex_set(const char* src, const struct stat* st, const SourceInfo* info);
+
+int negcache_has(const char* rwpath);
+void negcache_add(const char* rwpath);
+void negcache_forget(const char* rwpath);
+
+void dirindex_start();
+int dirindex_find(const char* path, int* type);
+int dirindex_list(const char* path, int (*add)(void* arg, const char* name, const struct stat* st, int type), void* arg);
+void dirindex_forget(const char* path);
+
+void watch_start();
+void watch_written(const char* file);
+
+struct Flight;
+Flight* inflight_begin(int kind, const char* name);
+int inflight_wait(Flight* f);
+void inflight_end(int kind, const char* name, int result, int shared);
 
 void memcache_init();
 int memcache_getfd(const std::string& name);
+int memcache_has(const std::string& name);
+void memcache_forget(const std::string& name);
 int memcache_store(const std::string& name, unsigned char* dds, unsigned int len);
+int memcache_reserve(const std::string& name, unsigned char* dds, unsigned int len, unsigned int ready);
+int memcache_dup(int fd);
+void memcache_progress(int fd, unsigned int ready);
+void memcache_fail(int fd);
+const volatile int* memcache_waiters(int fd);
 int memcache_read(int fd, char* buf, size_t size, off_t offset);
 int memcache_release(int fd);
 
+int cache_write(const char* path, const char* rwpath, unsigned char* dds, int len);
+int ddsfs_source(const char* rwpath, char* srcpath);
+int ddsfs_probe(int type, const char* srcpath, const char* name);
+int ddsfs_lookup(const char* path, const char* rwpath, int atfd, const char* name, struct stat* stbuf, int* type, char* srcpath);
+int ddsfs_list(const char* path, const char* rwpath, int atfd, int (*add)(void* arg, const char* name, const struct stat* st), void* arg);
+int ddsfs_openfile(const char* path, const char* rwpath, int atfd, const char* name, int flags, int type, const char* srcpath);
+int ddsfs_close(int fd);
+
+#if USE_FUSE3
+int lowlevel_main(struct fuse_args* args);
+void lowlevel_invalidate(const char* path);
+#endif
+
+int ddsfs_convert(int type, char* src, unsigned char** dst);
+void convert_init();
+void convert_thread_setup(int background);
+int convert_open(const char* path, const char* rwpath, const char* src, int type);
+int convert_queue(const char* path, const char* rwpath, const char* src, int type, int prio, unsigned int bytes);
+int convert_now(const char* rwpath, int type, char* src, unsigned char** dst);
+int convert_begin(unsigned char* dds, unsigned int len, unsigned int ready);
+void convert_progress(unsigned int ready);
+int convert_compress(const unsigned char* rgba, unsigned char* out, int width, int height, int format, unsigned char* next, const unsigned char* dds);
+
+void prefetch_init();
+void prefetch_save();
+void prefetch_opened(const char* path);
+void prefetch_ter(const char* path);
+void prefetch_listed(std::list<std::string>& paths);
+
 #if USE_JPG
 int ddsfs_jpg_header(const char* src, int* width, int* height);
 int ddsfs_jpg_dxt1(char* src, unsigned char** dst);
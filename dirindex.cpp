@@ -0,0 +1,322 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <list>
+#include <atomic>
+#include "ddsfs.h"
+using namespace std;
+
+// With -o dirindex, every directory under the source path is read into memory
+// at mount by a few threads at once, along with which source each converted
+// name comes from. getattr and readdir are then answered from here instead of
+// trying each source extension in turn. A directory is read again when its
+// modification time changes, which is checked at most every DIRCHECK. Only
+// what each name is is kept, and attributes come from the file itself.
+
+struct IndexName {
+	int8_t type;	// SRC_*, or -1 for a file which is really there.
+	uint32_t mode;	// Just the file type, for listings.
+	uint64_t ino;
+};
+
+struct IndexDir {
+	int64_t mtime;
+	int64_t checked;
+	unordered_map<string, IndexName> names;
+};
+
+static pthread_rwlock_t indexlock = PTHREAD_RWLOCK_INITIALIZER;
+// Keyed by path from the mount root, without a trailing slash, so the root is "".
+static unordered_map<string, IndexDir*> dirs;
+// Set with release once the scan is done, so readers loading it with acquire see every directory.
+static std::atomic<int> ready(0);
+
+// Startup scan queue.
+static pthread_mutex_t scanlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scanwork = PTHREAD_COND_INITIALIZER;
+static list<string> scanqueue;
+static int scanbusy = 0;
+static unsigned long scandirs = 0, scanentries = 0;
+
+static int64_t stat_mtime(const struct stat* st) {
+	return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// Real files beat converted ones, then sources go in the order ddsfs_source tries them.
+static void dirindex_add(IndexDir* dir, const string& name, int type, const struct stat* st) {
+	auto i = dir->names.find(name);
+	if (i != dir->names.end() && i->second.type <= type) return;
+	IndexName& n = dir->names[name];
+	n.type = type;
+	n.mode = st->st_mode & S_IFMT;
+	n.ino = st->st_ino;
+}
+
+// Reads one directory. Subdirectories are added to subdirs if it's given.
+// Returns NULL if path isn't a directory.
+static IndexDir* dirindex_read(const string& path, list<string>* subdirs, unsigned long* entries) {
+	string rwpath = config.basepath + path;
+	int fd = open(rwpath.empty() ? "/" : rwpath.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return NULL;
+	struct stat st;
+	DIR* dp;
+	if (fstat(fd, &st) == -1 || !(dp = fdopendir(fd))) {
+		close(fd);
+		return NULL;
+	}
+
+	IndexDir* dir = new IndexDir;
+	dir->mtime = stat_mtime(&st);
+	dir->checked = monotonic_ns();
+
+	struct dirent* de;
+	while ((de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+		if (entries) (*entries)++;
+
+		string name = de->d_name;
+		dirindex_add(dir, name, -1, &st);
+		if (S_ISDIR(st.st_mode)) {
+			if (subdirs) subdirs->push_back(path + "/" + name);
+			continue;
+		}
+
+		size_t dot = name.rfind('.');
+		if (dot == string::npos) continue;
+		const char* ext = name.c_str() + dot;
+		#if USE_JPG
+		if (!strcasecmp(ext, ".jpg")) dirindex_add(dir, name.substr(0, dot) + ".dds", SRC_JPG, &st);
+		#endif
+		#if USE_WEBP
+		if (!strcasecmp(ext, ".webp")) dirindex_add(dir, name.substr(0, dot) + ".dds", SRC_WEBP, &st);
+		#endif
+		// getattr only looks for .jpg and .webp behind a .dds, and needs an extension on the rest.
+		string plain = name.substr(0, dot);
+		size_t plaindot = plain.rfind('.');
+		if (plaindot == string::npos || !strcasecmp(plain.c_str() + plaindot, ".dds")) continue;
+		#if USE_GZIP
+		if (!strcasecmp(ext, ".gz")) dirindex_add(dir, plain, SRC_GZIP, &st);
+		#endif
+		#if USE_XZ
+		if (!strcasecmp(ext, ".xz")) dirindex_add(dir, plain, SRC_XZ, &st);
+		#endif
+	}
+	closedir(dp);
+	return dir;
+}
+
+// Call with indexlock held for writing.
+static void dirindex_put(const string& path, IndexDir* dir) {
+	auto i = dirs.find(path);
+	if (i != dirs.end()) {
+		delete i->second;
+		i->second = dir;
+	} else {
+		dirs.emplace(path, dir);
+	}
+}
+
+static void* dirindex_scan_thread(void*) {
+	convert_thread_setup(1);
+	pthread_mutex_lock(&scanlock);
+	while (1) {
+		while (scanqueue.empty() && scanbusy) pthread_cond_wait(&scanwork, &scanlock);
+		if (scanqueue.empty()) break;
+		string path = scanqueue.front();
+		scanqueue.pop_front();
+		scanbusy++;
+		pthread_mutex_unlock(&scanlock);
+
+		list<string> subdirs;
+		unsigned long entries = 0;
+		IndexDir* dir = dirindex_read(path, &subdirs, &entries);
+		if (dir) {
+			pthread_rwlock_wrlock(&indexlock);
+			dirindex_put(path, dir);
+			pthread_rwlock_unlock(&indexlock);
+		}
+
+		pthread_mutex_lock(&scanlock);
+		if (dir) scandirs++;
+		scanentries += entries;
+		scanqueue.splice(scanqueue.end(), subdirs);
+		scanbusy--;
+		pthread_cond_broadcast(&scanwork);
+	}
+	pthread_mutex_unlock(&scanlock);
+	return NULL;
+}
+
+static void* dirindex_scan(void*) {
+	int64_t start = monotonic_ns();
+	unsigned int count = config.threads ? config.threads : 1;
+	pthread_t threads[count];
+	scanqueue.push_back("");
+
+	unsigned int started = 0;
+	for (; started < count; started++) {
+		if (pthread_create(&threads[started], NULL, dirindex_scan_thread, NULL) != 0) break;
+	}
+	if (started == 0) dirindex_scan_thread(NULL);
+	for (unsigned int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+	double secs = (monotonic_ns() - start) / 1e9;
+	printf("dirindex: Read %lu directories and %lu entries in %.2f s with %u threads, %.0f entries/s.\n",
+		scandirs, scanentries, secs, started ? started : 1, secs > 0 ? scanentries / secs : 0.0);
+	ready.store(1, std::memory_order_release);
+	return NULL;
+}
+
+// Starts reading the source path in the background. Called from FUSE's init,
+// so the threads belong to the daemon. Until it's done, nothing is answered from here.
+void dirindex_start() {
+	if (!config.dirindex) return;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, dirindex_scan, NULL) != 0) {
+		fprintf(stderr, "dirindex: Could not start scan.\n");
+		return;
+	}
+	pthread_detach(thread);
+}
+
+// Makes sure the index of directory path is up to date. Directories which
+// weren't there at mount are read the first time they're asked about.
+// Returns 0 if path isn't a directory.
+static int dirindex_fresh(const string& path) {
+	int64_t now = monotonic_ns();
+	int64_t mtime = -1;
+	pthread_rwlock_rdlock(&indexlock);
+	auto i = dirs.find(path);
+	if (i != dirs.end()) {
+		if (now - i->second->checked < DIRCHECK) {
+			pthread_rwlock_unlock(&indexlock);
+			return 1;
+		}
+		mtime = i->second->mtime;
+	}
+	pthread_rwlock_unlock(&indexlock);
+
+	struct stat st;
+	string rwpath = config.basepath + path;
+	if (stat(rwpath.empty() ? "/" : rwpath.c_str(), &st) == -1 || !S_ISDIR(st.st_mode)) {
+		if (mtime != -1) {
+			pthread_rwlock_wrlock(&indexlock);
+			auto j = dirs.find(path);
+			if (j != dirs.end()) {
+				delete j->second;
+				dirs.erase(j);
+			}
+			pthread_rwlock_unlock(&indexlock);
+		}
+		return 0;
+	}
+
+	if (stat_mtime(&st) == mtime) {
+		pthread_rwlock_wrlock(&indexlock);
+		auto j = dirs.find(path);
+		if (j != dirs.end()) j->second->checked = now;
+		pthread_rwlock_unlock(&indexlock);
+		return 1;
+	}
+
+	if (DEBUG >= 2) printf("dirindex: Reading '%s' again.\n", path.c_str());
+	IndexDir* dir = dirindex_read(path, NULL, NULL);
+	if (!dir) return 0;
+	pthread_rwlock_wrlock(&indexlock);
+	dirindex_put(path, dir);
+	pthread_rwlock_unlock(&indexlock);
+	return 1;
+}
+
+static string dirindex_parent(const char* path, const char** name) {
+	const char* slash = strrchr(path, '/');
+	*name = slash ? slash + 1 : path;
+	return string(path, slash ? slash - path : 0);
+}
+
+// Looks up path, which is relative to the mount, and sets type to SRC_* or -1.
+// Returns 0 if found, -ENOENT if it's known not to be there, or 1 if the
+// index can't say.
+int dirindex_find(const char* path, int* type) {
+	if (!ready.load(std::memory_order_acquire)) return 1;
+	const char* name;
+	string parent = dirindex_parent(path, &name);
+	if (!*name || !dirindex_fresh(parent)) return 1;
+
+	int ret = 1;
+	pthread_rwlock_rdlock(&indexlock);
+	auto i = dirs.find(parent);
+	if (i != dirs.end()) {
+		auto j = i->second->names.find(name);
+		if (j != i->second->names.end()) {
+			*type = j->second.type;
+			ret = 0;
+		} else {
+			ret = -ENOENT;
+		}
+	}
+	pthread_rwlock_unlock(&indexlock);
+	return ret;
+}
+
+// Calls add for everything in directory path, until it returns nonzero. Only
+// the file type and inode number are filled in, as readdir needs. Returns 0 if it was listed, or 1 if the index can't say.
+int dirindex_list(const char* path, int (*add)(void* arg, const char* name, const struct stat* st, int type), void* arg) {
+	if (!ready.load(std::memory_order_acquire)) return 1;
+	string dir = path;
+	while (!dir.empty() && dir.back() == '/') dir.pop_back();
+	if (!dirindex_fresh(dir)) return 1;
+
+	int ret = 1;
+	pthread_rwlock_rdlock(&indexlock);
+	auto i = dirs.find(dir);
+	if (i != dirs.end()) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		for (auto& j : i->second->names) {
+			st.st_mode = j.second.mode;
+			st.st_ino = j.second.ino;
+			if (add(arg, j.first.c_str(), &st, j.second.type)) break;
+		}
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&indexlock);
+	return ret;
+}
+
+// Makes the next lookup in directory path read it again, for when a file in
+// it changed without the directory's own modification time changing.
+void dirindex_forget(const char* path) {
+	pthread_rwlock_wrlock(&indexlock);
+	auto i = dirs.find(path);
+	if (i != dirs.end()) {
+		i->second->mtime = -1;
+		i->second->checked = 0;
+	}
+	pthread_rwlock_unlock(&indexlock);
+}
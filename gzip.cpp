@@ -73,7 +73,7 @@ int ddsfs_gzip(const char* src, unsigned char** dst) {
 		return -1;
 	}
 	
-	*dst = (unsigned char*)memalign(16, footer.len);
+	*dst = (unsigned char*)bufpool_get(footer.len);
 	
 	len = gzread(gd, *dst, footer.len);
 	if ((unsigned)len != footer.len) {
@@ -84,7 +84,7 @@ int ddsfs_gzip(const char* src, unsigned char** dst) {
 	int ret = gzclose(gd);
 	if (ret != Z_OK) {
 		fprintf(stderr, "GZIP: Decompressing gave error code %d for .gz file: %s\n", ret, src);
-		free(*dst);
+		bufpool_put(*dst);
 		*dst = NULL;
 		return -1;
 	}
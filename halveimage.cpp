@@ -10,6 +10,12 @@
 #else
 #include <emmintrin.h>
 #endif
+#include <string.h>
+#include <libdxt.h>
+#include "ddsfs.h"
+#if defined(DXT_AVX)
+#include <immintrin.h>
+#endif
 
 inline static unsigned int avg2(unsigned int a, unsigned int b) {
     return (((a^b) & 0xfefefefeUL) >> 1) + (a&b);
@@ -45,10 +51,104 @@ inline static void average2Rows(const unsigned int* src_row1, const unsigned int
 #endif
 }
 
+#if defined(DXT_AVX)
+// The SSE version averages pixels 0-3 with 4-7 in one register. Here each 128-bit lane does the same
+// for its own group of 8 pixels, so the result is identical.
+__attribute__((target("avx2")))
+static void average2Rows_AVX2(const unsigned int* src_row1, const unsigned int* src_row2, unsigned int* dst_row, int w) {
+	int x = w;
+	for (; x >= 8; x-=8, dst_row+=8, src_row1 += 16, src_row2 += 16) {
+		__m256i a = _mm256_avg_epu8(_mm256_loadu_si256((__m256i const*)src_row1), _mm256_loadu_si256((__m256i const*)src_row2));
+		__m256i b = _mm256_avg_epu8(_mm256_loadu_si256((__m256i const*)(src_row1+8)), _mm256_loadu_si256((__m256i const*)(src_row2+8)));
+		__m256i left  = _mm256_permute2x128_si256(a, b, 0x20);
+		__m256i right = _mm256_permute2x128_si256(a, b, 0x31);
+
+		__m256i t0 = _mm256_unpacklo_epi32(left, right);
+		__m256i t1 = _mm256_unpackhi_epi32(left, right);
+		__m256i shuffle1 = _mm256_unpacklo_epi32(t0, t1);
+		__m256i shuffle2 = _mm256_unpackhi_epi32(t0, t1);
+
+		_mm256_storeu_si256((__m256i *)dst_row, _mm256_avg_epu8(shuffle1, shuffle2));
+	}
+	if (x) average2Rows(src_row1, src_row2, dst_row, x);
+}
+
+// See intrinsic_avx512.cpp, GCC takes _mm512_undefined_epi32 in the unpacks for uninitialised use.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f,avx512bw")))
+static void average2Rows_AVX512(const unsigned int* src_row1, const unsigned int* src_row2, unsigned int* dst_row, int w) {
+	const __m512i leftidx  = _mm512_setr_epi64(0, 1, 4, 5, 8, 9, 12, 13);
+	const __m512i rightidx = _mm512_setr_epi64(2, 3, 6, 7, 10, 11, 14, 15);
+	int x = w;
+	for (; x >= 16; x-=16, dst_row+=16, src_row1 += 32, src_row2 += 32) {
+		__m512i a = _mm512_avg_epu8(_mm512_loadu_si512(src_row1), _mm512_loadu_si512(src_row2));
+		__m512i b = _mm512_avg_epu8(_mm512_loadu_si512(src_row1+16), _mm512_loadu_si512(src_row2+16));
+		__m512i left  = _mm512_permutex2var_epi64(a, leftidx, b);
+		__m512i right = _mm512_permutex2var_epi64(a, rightidx, b);
+
+		__m512i t0 = _mm512_unpacklo_epi32(left, right);
+		__m512i t1 = _mm512_unpackhi_epi32(left, right);
+		__m512i shuffle1 = _mm512_unpacklo_epi32(t0, t1);
+		__m512i shuffle2 = _mm512_unpackhi_epi32(t0, t1);
+
+		_mm512_storeu_si512(dst_row, _mm512_avg_epu8(shuffle1, shuffle2));
+	}
+	if (x) average2Rows_AVX2(src_row1, src_row2, dst_row, x);
+}
+#pragma GCC diagnostic pop
+#endif
+
 void halveimage(const unsigned char* src, int width, int height, unsigned char* dst) {
 	const unsigned int* isrc = (const unsigned int*)src;
 	unsigned int* idst = (unsigned int*)dst;
+	void (*avg)(const unsigned int*, const unsigned int*, unsigned int*, int) = average2Rows;
+#if defined(DXT_AVX)
+	if (DXTGetSIMD() == DXT_SIMD_AVX2) avg = average2Rows_AVX2;
+	else if (DXTGetSIMD() == DXT_SIMD_AVX512) avg = average2Rows_AVX512;
+#endif
 	for (int r = 0; r < height; r+=2) {
-		average2Rows(isrc + (r*width), isrc + ((r+1)*width), idst + ((r/2)*(width/2)), width/2);
+		avg(isrc + (r*width), isrc + ((r+1)*width), idst + ((r/2)*(width/2)), width/2);
+	}
+}
+
+// Any-size version of halveimage, to floor(width/2) x floor(height/2). Both images use
+// PADDED() row pitch, and the result is padded for the DXT encoder. Sizes the SSE code
+// can't do are box filtered, with a third row or column folded in where a side is odd.
+void shrinkimage(const unsigned char* src, int width, int height, unsigned char* dst) {
+	int dw = width / 2, dh = height / 2;
+	if (width % 8 == 0 && height % 2 == 0) {
+		halveimage(src, width, height, dst);
+	} else {
+		int spitch = PADDED(width) * 4, dpitch = PADDED(dw) * 4;
+		for (int y = 0; y < dh; y++) {
+			int y0 = y * height / dh, y1 = (y+1) * height / dh;
+			unsigned char* out = dst + y * dpitch;
+			for (int x = 0; x < dw; x++) {
+				int x0 = x * width / dw, x1 = (x+1) * width / dw;
+				int count = (y1 - y0) * (x1 - x0);
+				unsigned int sum[4] = { 0, 0, 0, 0 };
+				for (int sy = y0; sy < y1; sy++) {
+					const unsigned char* in = src + sy * spitch + x0 * 4;
+					for (int sx = x0; sx < x1; sx++, in += 4) {
+						sum[0] += in[0]; sum[1] += in[1]; sum[2] += in[2]; sum[3] += in[3];
+					}
+				}
+				for (int c = 0; c < 4; c++) out[x*4+c] = (sum[c] + count/2) / count;
+			}
+		}
 	}
-}
\ No newline at end of file
+	padimage(dst, dw, dh);
+}
+
+// Fills the padding to the right and below a PADDED() image by repeating its edge pixels.
+void padimage(unsigned char* img, int width, int height) {
+	int pitch = PADDED(width) * 4;
+	if (PADDED(width) != width) {
+		for (int y = 0; y < height; y++) {
+			unsigned int* row = (unsigned int*)(img + y * pitch);
+			for (int x = width; x < PADDED(width); x++) row[x] = row[width-1];
+		}
+	}
+	for (int y = height; y < PADDED(height); y++) memcpy(img + y * pitch, img + (height-1) * pitch, pitch);
+}
@@ -0,0 +1,136 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "ddsfs.h"
+using namespace std;
+
+// Work which is being done for a file right now, so anybody else who wants
+// the same thing waits for that result instead of doing it all again.
+
+struct Flight {
+	int refs;
+	int done;
+	int result;
+	int hold;	// Our own handle on a shared result, copied for each waiter.
+	pthread_cond_t cond;
+};
+
+static pthread_mutex_t flightlock = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<string, Flight*> flights;
+
+// Kinds of work get their own keys, so a header read never waits on a conversion.
+static string flight_key(int kind, const char* name) {
+	string key(1, (char)('0' + kind));
+	key += name;
+	return key;
+}
+
+static int handle_dup(int fd) {
+	if (fd >= MEMCACHE_FDBASE) {
+		int ret = memcache_dup(fd);
+		return ret > 0 ? ret : -EIO;
+	}
+	int ret = dup(fd);
+	return ret != -1 ? ret : -errno;
+}
+
+static void handle_close(int fd) {
+	if (fd >= MEMCACHE_FDBASE) memcache_release(fd);
+	else close(fd);
+}
+
+// Call with flightlock held.
+static void flight_release(Flight* f) {
+	if (--f->refs == 0) {
+		if (f->hold > 0) handle_close(f->hold);
+		pthread_cond_destroy(&f->cond);
+		delete f;
+	}
+}
+
+// Returns NULL if nobody else is working on name, in which case the caller
+// must do the work and then call inflight_end. Otherwise pass the result to
+// inflight_wait.
+Flight* inflight_begin(int kind, const char* name) {
+	string key = flight_key(kind, name);
+	Flight* f = NULL;
+
+	pthread_mutex_lock(&flightlock);
+	auto i = flights.find(key);
+	if (i != flights.end()) {
+		f = i->second;
+		f->refs++;
+	} else {
+		Flight* lead = new Flight;
+		lead->refs = 1;
+		lead->done = 0;
+		lead->result = 0;
+		lead->hold = 0;
+		pthread_cond_init(&lead->cond, NULL);
+		flights.emplace(key, lead);
+	}
+	pthread_mutex_unlock(&flightlock);
+
+	if (f && DEBUG >= 2) printf("inflight: Waiting for '%s'.\n", name);
+	return f;
+}
+
+// Gives the leader's result. A shared handle comes back as a new handle to
+// the same file, which the caller owns.
+int inflight_wait(Flight* f) {
+	pthread_mutex_lock(&flightlock);
+	while (!f->done) pthread_cond_wait(&f->cond, &flightlock);
+	int ret = f->hold > 0 ? handle_dup(f->hold) : f->result;
+	flight_release(f);
+	pthread_mutex_unlock(&flightlock);
+	return ret;
+}
+
+// If shared is set, result is a descriptor or memcache handle for the
+// finished file, and every waiter gets their own. Negative results are
+// passed on as they are.
+void inflight_end(int kind, const char* name, int result, int shared) {
+	string key = flight_key(kind, name);
+	int hold = 0;
+	if (shared && result > 0) {
+		hold = handle_dup(result);
+		if (hold < 0) {
+			result = hold;
+			hold = 0;
+		}
+	}
+
+	pthread_mutex_lock(&flightlock);
+	auto i = flights.find(key);
+	if (i == flights.end()) {
+		pthread_mutex_unlock(&flightlock);
+		fprintf(stderr, "inflight: Ended '%s' which was never begun!\n", name);
+		if (hold > 0) handle_close(hold);
+		return;
+	}
+	Flight* f = i->second;
+	flights.erase(i);
+	f->done = 1;
+	f->result = result;
+	f->hold = hold;
+	pthread_cond_broadcast(&f->cond);
+	flight_release(f);
+	pthread_mutex_unlock(&flightlock);
+}
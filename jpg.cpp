@@ -16,10 +16,33 @@
 #include <stdlib.h>
 #include <sys/timeb.h>
 #include <errno.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include <emmintrin.h>
 #include <turbojpeg.h>
+#include <jpeglib.h>
 #include <libdxt.h>
 #include "ddsfs.h"
 
+// Pixels colour converted and compressed at once from a planar YUV decode.
+#define YUVBAND (64*1024)
+// Fewest rows decoded on their own between restart markers.
+#define JPGBANDMIN 64
+
+
+// Decompressors are kept for the life of each thread instead of made per file.
+struct jpg_handle {
+	tjhandle tj;
+	jpg_handle() { tj = tjInitDecompress(); }
+	~jpg_handle() { tjDestroy(tj); }
+};
+
+static tjhandle jpg_decoder() {
+	static thread_local jpg_handle handle;
+	return handle.tj;
+}
 
 
 int ddsfs_jpg_header(const char* src, int* width, int* height) {
@@ -29,23 +52,469 @@ int ddsfs_jpg_header(const char* src, int* width, int* height) {
 		return -1;
 	}
 	size_t size = lseek(fd, 0, SEEK_END);
-	unsigned char* jpeg = (unsigned char*)memalign(16, size);
+	unsigned char* jpeg = (unsigned char*)bufpool_get(size);
 	lseek(fd, 0, SEEK_SET);
 	size = read(fd, jpeg, size);
 	close(fd);
 	
-	tjhandle tj = tjInitDecompress();
+	tjhandle tj = jpg_decoder();
 	int subsamp, colourspace;
 	int ret = tjDecompressHeader3(tj, jpeg, size, width, height, &subsamp, &colourspace);
-	free(jpeg);
-	tjDestroy(tj);
+	bufpool_put(jpeg);
 	if (ret == -1) {
-		fprintf(stderr, "JPG: Could not decode header for '%s': %s\n", src, tjGetErrorStr());
+		fprintf(stderr, "JPG: Could not decode header for '%s': %s\n", src, tjGetErrorStr2(tj));
 		return -1;
 	}
 	return 0;
 }
 
+static const char* mipgen_names[] = { "halve", "dct", "dct8" };
+
+// Allocates the output for a DXT1 texture and writes its header.
+static int dxt1_header(int width, int height, int* mips, unsigned char** dst) {
+	DDS_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.dwMagic = 0x20534444;
+	header.dwSize = 124;
+	header.dwFlags = 0x1 | 0x2 | 0x4 | 0x1000;
+	header.dwHeight = height;
+	header.dwWidth = width;
+	header.dwCaps = 0x1000;
+	
+	*mips = dds_mips(width, height);
+	int totalsize = sizeof(header);
+	for (int i = 0; i < *mips; i++) totalsize += dds_dxtsize(width >> i, height >> i, 0);
+	if (DEBUG) printf("DXT1: Allocating %d bytes for %d mip%s from %dx%d.\n", totalsize, *mips, *mips==1?"":"s", width, height);
+	header.dwFlags |= 0x20000;
+	header.dwMipMapCount = *mips;
+	header.dwCaps |= 0x8 | 0x400000;
+	
+	DDS_PIXELFORMAT ddspix;
+	memset(&ddspix, 0, sizeof(ddspix));
+	ddspix.dwSize = 32;
+	ddspix.dwFlags = 0x4;
+	ddspix.dwFourCC = 'D' | 'X'<<8 | 'T'<<16 | '1'<<24;
+	header.ddspf = ddspix;
+
+	*dst = (unsigned char*)bufpool_get(totalsize);
+	memcpy(*dst, &header, sizeof(header));
+	return totalsize;
+}
+
+
+struct jpg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
+};
+
+static void jpg_error_exit(j_common_ptr cinfo) {
+	jpg_error* err = (jpg_error*)cinfo->err;
+	(*cinfo->err->format_message)(cinfo, err->message);
+	longjmp(err->jump, 1);
+}
+
+// Decodes STRIPROWS scanlines at a time with the libjpeg API and hands each
+// strip to a MipStream, so the full-size RGBA image never exists in memory.
+static int jpg_dxt1_stream(const char* src, unsigned char* jpeg, size_t size, unsigned char** dst) {
+	struct jpeg_decompress_struct cinfo;
+	jpg_error err;
+	MipStream* volatile ms = NULL;
+	volatile int owned = 0;
+	
+	*dst = NULL;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpg_error_exit;
+	if (setjmp(err.jump)) {
+		fprintf(stderr, "DXT1: Could not decode image for '%s': %s\n", src, err.message);
+		jpeg_destroy_decompress(&cinfo);
+		delete ms;
+		if (!owned) bufpool_put(*dst);
+		*dst = NULL;
+		return -1;
+	}
+	
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, jpeg, size);
+	jpeg_read_header(&cinfo, TRUE);
+	// Same output as tjDecompress2 with TJFLAG_FASTDCT|TJFLAG_FASTUPSAMPLE.
+	cinfo.out_color_space = JCS_EXT_RGBA;
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(&cinfo);
+	
+	int width = cinfo.output_width, height = cinfo.output_height, mips;
+	int totalsize = dxt1_header(width, height, &mips, dst);
+	owned = convert_begin(*dst, totalsize, sizeof(DDS_HEADER));
+	ms = new MipStream(width, height, mips, 0, *dst + sizeof(DDS_HEADER));
+	
+	JSAMPROW rows[STRIPROWS];
+	while (cinfo.output_scanline < cinfo.output_height) {
+		int count = ms->space();
+		unsigned char* pos = ms->rows();
+		for (int i = 0; i < count; i++) rows[i] = pos + i * width * 4;
+		ms->commit(jpeg_read_scanlines(&cinfo, rows, count));
+	}
+	
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	delete ms;
+	return totalsize;
+}
+
+// libjpeg's YCbCr to RGB in 16.16 fixed point, with the constants split so
+// every multiply fits a 16-bit lane and the rounding stays identical to a
+// TJPF_RGBA decode:
+//   R = Y + Cr + 0.40200 * Cr
+//   G = Y - Cr - 0.34414 * Cb + 0.28586 * Cr
+//   B = Y + 2 * Cb - 0.22800 * Cb
+// Takes 8 chroma samples, already centred on 0, and gives the terms to add to Y.
+static inline void yuv_terms(__m128i cb, __m128i cr, __m128i* r, __m128i* g, __m128i* b) {
+	const __m128i two = _mm_set1_epi16(2);
+	const __m128i kr = _mm_set1_epi32(26345 | 16384 << 16);
+	const __m128i kg = _mm_set1_epi32((-22554 & 0xffff) | 18734 << 16);
+	const __m128i kb = _mm_set1_epi32((-14942 & 0xffff) | 16384 << 16);
+	const __m128i half = _mm_set1_epi32(32768);
+	
+	__m128i lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cr, two), kr), 16);
+	__m128i hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cr, two), kr), 16);
+	*r = _mm_add_epi16(_mm_packs_epi32(lo, hi), cr);
+	
+	lo = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, cr), kg), half), 16);
+	hi = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, cr), kg), half), 16);
+	*g = _mm_sub_epi16(_mm_packs_epi32(lo, hi), cr);
+	
+	lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(cb, two), kb), 16);
+	hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(cb, two), kb), 16);
+	*b = _mm_add_epi16(_mm_packs_epi32(lo, hi), _mm_add_epi16(cb, cb));
+}
+
+// Adds the chroma terms to 8 luma samples and stores them as RGBA.
+static inline void yuv_store(const unsigned char* luma, __m128i r, __m128i g, __m128i b, unsigned char* out) {
+	__m128i y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)luma), _mm_setzero_si128());
+	__m128i rb = _mm_packus_epi16(_mm_add_epi16(y, r), _mm_add_epi16(y, b));
+	__m128i ga = _mm_packus_epi16(_mm_add_epi16(y, g), _mm_set1_epi16(255));
+	__m128i rg = _mm_unpacklo_epi8(rb, ga);
+	__m128i ba = _mm_unpackhi_epi8(rb, ga);
+	_mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi16(rg, ba));
+	_mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+// Converts rows [row, row+rows) of the planes to RGBA, 16 pixels at a time.
+// Chroma is replicated like TJFLAG_FASTUPSAMPLE does, and with 4:2:0 each set
+// of chroma terms is worked out once and used for both rows of its 2x2 groups.
+static void yuv_band(unsigned char** planes, const int* strides, int subsamp, int width, int row, int rows, unsigned char* rgba) {
+	const __m128i centre = _mm_set1_epi16(128);
+	const __m128i zero = _mm_setzero_si128();
+	int share = subsamp == TJSAMP_420 ? 2 : 1;
+	
+	for (int y = row; y < row + rows; y += share) {
+		int cy = y / share;
+		const unsigned char* cbrow = planes[1] + cy * strides[1];
+		const unsigned char* crrow = planes[2] + cy * strides[2];
+		for (int x = 0; x < width; x += 16) {
+			__m128i r[2], g[2], b[2];
+			if (subsamp == TJSAMP_444) {
+				__m128i cb = _mm_loadu_si128((const __m128i*)(cbrow + x));
+				__m128i cr = _mm_loadu_si128((const __m128i*)(crrow + x));
+				for (int i = 0; i < 2; i++) {
+					__m128i cb16 = _mm_sub_epi16(i ? _mm_unpackhi_epi8(cb, zero) : _mm_unpacklo_epi8(cb, zero), centre);
+					__m128i cr16 = _mm_sub_epi16(i ? _mm_unpackhi_epi8(cr, zero) : _mm_unpacklo_epi8(cr, zero), centre);
+					yuv_terms(cb16, cr16, &r[i], &g[i], &b[i]);
+				}
+			} else {
+				__m128i cb16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(cbrow + x/2)), zero), centre);
+				__m128i cr16 = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(crrow + x/2)), zero), centre);
+				__m128i rt, gt, bt;
+				yuv_terms(cb16, cr16, &rt, &gt, &bt);
+				r[0] = _mm_unpacklo_epi16(rt, rt); r[1] = _mm_unpackhi_epi16(rt, rt);
+				g[0] = _mm_unpacklo_epi16(gt, gt); g[1] = _mm_unpackhi_epi16(gt, gt);
+				b[0] = _mm_unpacklo_epi16(bt, bt); b[1] = _mm_unpackhi_epi16(bt, bt);
+			}
+			
+			for (int s = 0; s < share; s++) {
+				const unsigned char* luma = planes[0] + (y + s) * strides[0] + x;
+				unsigned char* out = rgba + ((y + s - row) * width + x) * 4;
+				yuv_store(luma, r[0], g[0], b[0], out);
+				if (x + 8 < width) yuv_store(luma + 8, r[1], g[1], b[1], out + 32);
+			}
+		}
+	}
+}
+
+struct yuv_task {
+	unsigned char** planes;
+	const int* strides;
+	int subsamp;
+	int width, height;
+	int band;
+	unsigned char* out;
+	unsigned char* half;
+	int first;		// Task of the group being done.
+};
+
+// Colour converts one band into a buffer small enough to stay in cache, then
+// compresses it and halves it into the next level before it's dropped.
+static void yuv_run(void* arg, int index) {
+	yuv_task* t = (yuv_task*)arg;
+	int row = (t->first + index) * t->band;
+	int rows = std::min(t->band, t->height - row);
+	unsigned char* rgba = (unsigned char*)bufpool_get(t->width * t->band * 4);
+	yuv_band(t->planes, t->strides, t->subsamp, t->width, row, rows, rgba);
+	CompressDXT(rgba, t->out + (row / 4) * (t->width / 4) * 8, t->width, rows, FORMAT_DXT1, 1);
+	if (t->half) halveimage(rgba, t->width, rows, t->half + (row / 2) * (t->width / 2) * 4);
+	bufpool_put(rgba);
+}
+
+// Encodes level 0 straight from the planes tjDecompressToYUVPlanes leaves, so
+// the full-size RGBA image never exists. Bands are shared out to the encoder
+// pool, and also halved into the next level if half is given. Needs a YCbCr
+// 4:4:4, 4:2:2 or 4:2:0 image whose width is a multiple of 8 and height a
+// multiple of 4. Progress is only reported when given the start of the DDS file.
+static int jpg_dxt1_yuv(unsigned char** planes, const int* strides, int subsamp, int width, int height, unsigned char* out, unsigned char* half, int threads, const unsigned char* dds) {
+	yuv_task task;
+	task.planes = planes;
+	task.strides = strides;
+	task.subsamp = subsamp;
+	task.width = width;
+	task.height = height;
+	task.band = std::max((YUVBAND / width) & ~3, 4);
+	task.out = out;
+	task.half = half;
+	
+	int tasks = (height + task.band - 1) / task.band;
+	int group = dds ? std::max(256 / task.band, 1) : tasks;
+	for (task.first = 0; task.first < tasks; task.first += group) {
+		DXTParallel(yuv_run, &task, std::min(group, tasks - task.first), threads);
+		int rows = std::min(height, (task.first + group) * task.band);
+		if (dds) convert_progress(out + (rows / 4) * (width / 4) * 8 - dds);
+	}
+	return (height / 4) * (width / 4) * 8;
+}
+
+static int yuv_usable(int subsamp, int colourspace, int width, int height) {
+	if (colourspace != TJCS_YCbCr) return 0;
+	if (subsamp != TJSAMP_444 && subsamp != TJSAMP_422 && subsamp != TJSAMP_420) return 0;
+	return width % 8 == 0 && height % 4 == 0;
+}
+
+// Whether mip level curmip comes from a scaled IDCT. It scales by rounding up,
+// so that only matches our levels where the halving is exact.
+static int dct_level(int width, int height, int curmip) {
+	int exact = !(width & ((1 << curmip) - 1)) && !(height & ((1 << curmip) - 1));
+	return exact && ((config.mipgen == MIPGEN_DCT && curmip <= 3) || (config.mipgen == MIPGEN_DCT8 && curmip == 3));
+}
+
+// Where each restart interval of a single-scan Huffman JPEG starts, so bands
+// of MCU rows between them can be decoded separately.
+struct jpg_restarts {
+	size_t header;		// Bytes before the entropy-coded data.
+	size_t sofheight;	// Offset of the frame height.
+	size_t end;			// Offset of the EOI marker.
+	int mcuwidth, mcuheight;
+	int interval;		// MCUs per restart interval.
+	std::vector<size_t> starts;
+};
+
+static int jpg_find_restarts(const unsigned char* jpeg, size_t size, int width, int height, jpg_restarts* rs) {
+	if (size < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8) return 0;
+	size_t pos = 2;
+	int components = 0;
+	rs->sofheight = 0;
+	rs->interval = 0;
+	while (1) {
+		while (pos + 1 < size && jpeg[pos] == 0xff && jpeg[pos + 1] == 0xff) pos++;
+		if (pos + 4 > size || jpeg[pos] != 0xff) return 0;
+		int marker = jpeg[pos + 1];
+		size_t len = jpeg[pos + 2] << 8 | jpeg[pos + 3];
+		if ((marker >= 0xd0 && marker <= 0xd9) || len < 2 || pos + 2 + len > size) return 0;
+		const unsigned char* seg = jpeg + pos + 4;
+		if (marker == 0xc0 || marker == 0xc1) {
+			components = len >= 8 ? seg[5] : 0;
+			if (!components || len < 8 + 3 * (size_t)components) return 0;
+			int hmax = 1, vmax = 1;
+			for (int i = 0; i < components; i++) {
+				hmax = std::max(hmax, seg[7 + i*3] >> 4);
+				vmax = std::max(vmax, seg[7 + i*3] & 15);
+			}
+			rs->sofheight = pos + 5;
+			rs->mcuwidth = 8 * hmax;
+			rs->mcuheight = 8 * vmax;
+		} else if (marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			return 0;	// Progressive, lossless or arithmetic coded.
+		} else if (marker == 0xdd) {
+			if (len < 4) return 0;
+			rs->interval = seg[0] << 8 | seg[1];
+		} else if (marker == 0xda) {
+			// Every component has to be in this one scan.
+			if (!rs->sofheight || !rs->interval || seg[0] != components) return 0;
+			pos += 2 + len;
+			break;
+		}
+		pos += 2 + len;
+	}
+	
+	rs->header = pos;
+	rs->starts.clear();
+	rs->starts.push_back(pos);
+	while (1) {
+		const unsigned char* ff = (const unsigned char*)memchr(jpeg + pos, 0xff, size - pos);
+		if (!ff || ff + 1 >= jpeg + size) return 0;
+		pos = ff - jpeg;
+		int marker = ff[1];
+		if (marker == 0xff) {
+			pos++;
+		} else if (marker == 0x00) {
+			pos += 2;
+		} else if (marker >= 0xd0 && marker <= 0xd7) {
+			pos += 2;
+			rs->starts.push_back(pos);
+		} else if (marker == 0xd9) {
+			rs->end = pos;
+			break;
+		} else {
+			return 0;	// Another scan, or DNL.
+		}
+	}
+	
+	size_t mcus = (size_t)((width + rs->mcuwidth - 1) / rs->mcuwidth) * ((height + rs->mcuheight - 1) / rs->mcuheight);
+	return rs->starts.size() == (mcus + rs->interval - 1) / rs->interval;
+}
+
+struct jpg_band {
+	int row, rows;
+	size_t first, last;		// Restart intervals it covers.
+};
+
+// Cuts the image into about count bands, at restart markers which fall between MCU rows.
+static void jpg_plan_bands(const jpg_restarts* rs, int width, int height, int count, std::vector<jpg_band>* bands) {
+	size_t perrow = (width + rs->mcuwidth - 1) / rs->mcuwidth;
+	int mcurows = (height + rs->mcuheight - 1) / rs->mcuheight;
+	int target = std::max((mcurows + count - 1) / count, JPGBANDMIN / rs->mcuheight);
+	size_t intervals = rs->starts.size();
+	
+	bands->clear();
+	int startrow = 0;
+	size_t first = 0;
+	for (size_t i = 1; i <= intervals; i++) {
+		size_t mcu = i * rs->interval;
+		int mcurow = i < intervals ? mcu / perrow : mcurows;
+		if (i < intervals && (mcu % perrow || mcurow - startrow < target)) continue;
+		
+		jpg_band band;
+		band.row = startrow * rs->mcuheight;
+		band.rows = std::min(mcurow * rs->mcuheight, height) - band.row;
+		band.first = first;
+		band.last = i - 1;
+		bands->push_back(band);
+		startrow = mcurow;
+		first = i;
+	}
+}
+
+struct jpg_bandjob {
+	const unsigned char* jpeg;
+	const jpg_restarts* rs;
+	const std::vector<jpg_band>* bands;
+	int width, subsamp;
+	unsigned char* out;
+	unsigned char* half;
+	const unsigned char* dds;
+	pthread_mutex_t lock;
+	size_t ready;		// Bands finished in order from the top.
+	std::vector<char> done;
+	volatile int failed;
+};
+
+// Makes a JPEG of just this band's intervals, with its own height and restart
+// markers renumbered from 0, then decodes and encodes it.
+static int jpg_dxt1_band(jpg_bandjob* job, const jpg_band& band) {
+	const jpg_restarts* rs = job->rs;
+	size_t intervals = rs->starts.size();
+	size_t from = rs->starts[band.first];
+	size_t to = band.last + 1 < intervals ? rs->starts[band.last + 1] : rs->end;
+	size_t len = rs->header + (to - from) + 2;
+	
+	unsigned char* part = (unsigned char*)bufpool_get(len);
+	memcpy(part, job->jpeg, rs->header);
+	part[rs->sofheight] = band.rows >> 8;
+	part[rs->sofheight + 1] = band.rows & 0xff;
+	unsigned char* pos = part + rs->header;
+	for (size_t i = band.first; i <= band.last; i++) {
+		size_t end = i + 1 < intervals ? rs->starts[i + 1] - 2 : rs->end;
+		memcpy(pos, job->jpeg + rs->starts[i], end - rs->starts[i]);
+		pos += end - rs->starts[i];
+		*pos++ = 0xff;
+		*pos++ = i < band.last ? 0xd0 + ((i - band.first) & 7) : 0xd9;
+	}
+	
+	unsigned char* planes[3];
+	int strides[3];
+	for (int i = 0; i < 3; i++) {
+		strides[i] = tjPlaneWidth(i, job->width, job->subsamp);
+		planes[i] = (unsigned char*)bufpool_get(strides[i] * tjPlaneHeight(i, band.rows, job->subsamp) + 16);
+	}
+	tjhandle tj = jpg_decoder();
+	int ok = tjDecompressToYUVPlanes(tj, part, pos - part, planes, 0, strides, 0, TJFLAG_FASTDCT) != -1;
+	if (!ok) fprintf(stderr, "DXT1: Could not decode rows %d-%d: %s\n", band.row, band.row + band.rows - 1, tjGetErrorStr2(tj));
+	bufpool_put(part);
+	
+	if (ok) {
+		unsigned char* out = job->out + (band.row / 4) * (job->width / 4) * 8;
+		unsigned char* half = job->half ? job->half + (band.row / 2) * (job->width / 2) * 4 : NULL;
+		jpg_dxt1_yuv(planes, strides, job->subsamp, job->width, band.rows, out, half, 1, NULL);
+	}
+	for (int i = 0; i < 3; i++) bufpool_put(planes[i]);
+	return ok;
+}
+
+// One band as a pool task. Progress can only be reported from the thread
+// doing the conversion, so it's a no-op on the others.
+static void jpg_run_band(void* arg, int index) {
+	jpg_bandjob* job = (jpg_bandjob*)arg;
+	const std::vector<jpg_band>& bands = *job->bands;
+	if (job->failed) return;
+	
+	int ok = jpg_dxt1_band(job, bands[index]);
+	
+	pthread_mutex_lock(&job->lock);
+	if (!ok) job->failed = 1;
+	job->done[index] = 1;
+	while (job->ready < bands.size() && job->done[job->ready]) job->ready++;
+	int rows = job->ready ? bands[job->ready - 1].row + bands[job->ready - 1].rows : 0;
+	pthread_mutex_unlock(&job->lock);
+	
+	convert_progress(job->out + (rows / 4) * (job->width / 4) * 8 - job->dds);
+}
+
+// Level 0 for JPEGs with restart markers between MCU rows. Each band is
+// entropy decoded, colour converted and compressed as its own task on the
+// encoder pool, so the Huffman decode isn't left running on one core. Same
+// output as jpg_dxt1_yuv.
+static int jpg_dxt1_bands(const unsigned char* jpeg, const jpg_restarts* rs, const std::vector<jpg_band>* bands, int subsamp, int width, int height, unsigned char* out, unsigned char* half, const unsigned char* dds) {
+	jpg_bandjob job;
+	job.jpeg = jpeg;
+	job.rs = rs;
+	job.bands = bands;
+	job.width = width;
+	job.subsamp = subsamp;
+	job.out = out;
+	job.half = half;
+	job.dds = dds;
+	pthread_mutex_init(&job.lock, NULL);
+	job.ready = 0;
+	job.done.assign(bands->size(), 0);
+	job.failed = 0;
+	
+	DXTParallel(jpg_run_band, &job, bands->size(), config.threads);
+	pthread_mutex_destroy(&job.lock);
+	
+	if (DEBUG >= 2) printf("DXT1: Decoded %d bands.\n", (int)bands->size());
+	if (job.failed) return -1;
+	return (height / 4) * (width / 4) * 8;
+}
+
+
 int ddsfs_jpg_dxt1(char* src, unsigned char** dst) {
 	struct timeb start, mid, end;
 	
@@ -61,108 +530,163 @@ int ddsfs_jpg_dxt1(char* src, unsigned char** dst) {
 	}
 	
 	size_t size = lseek(fd, 0, SEEK_END);
-	unsigned char* jpeg = (unsigned char*)memalign(16, size);
+	unsigned char* jpeg = (unsigned char*)bufpool_get(size);
 	lseek(fd, 0, SEEK_SET);
 	size = read(fd, jpeg, size);
 	close(fd);
 
-	tjhandle tj = tjInitDecompress();
+	tjhandle tj = jpg_decoder();
 	
 	int width, height, subsamp, colourspace;
 	if (tjDecompressHeader3(tj, jpeg, size, &width, &height, &subsamp, &colourspace) == -1) {
-		fprintf(stderr, "DXT1: Could not decode header for '%s': %s\n", src, tjGetErrorStr());
-		free(jpeg);
-		tjDestroy(tj);
+		fprintf(stderr, "DXT1: Could not decode header for '%s': %s\n", src, tjGetErrorStr2(tj));
+		bufpool_put(jpeg);
 		return -1;
 	}
 	if (DEBUG >= 2) printf("DXT1: Decoded %d x %d JPEG.\n", width, height);
 	
-	if (!poweroftwo(width) || !poweroftwo(height)) {
-		if (DEBUG) printf("DXT1: Not a power-of-two texture, falling back to RGB.\n");
-		free(jpeg);
-		tjDestroy(tj);
-		return ddsfs_jpg_rgb(src, dst);
+	// MipStream halves strips as they arrive, which needs every level to stay even.
+	if (config.stream && poweroftwo(width) && poweroftwo(height) && width >= 4 && height >= 4) {
+		int totalsize = jpg_dxt1_stream(src, jpeg, size, dst);
+		bufpool_put(jpeg);
+		
+		if (DEBUG) {
+			ftime(&end);
+			int diff = (1000.0 * (end.time - start.time) + (end.millitm - start.millitm));
+			printf("DXT1: Streaming decode and encode done in %d ms.\n", diff);
+		}
+		return totalsize;
 	}
 	
-	unsigned char* rgba = (unsigned char*)memalign(16, width * height * 4);
-	if (tjDecompress2(tj, jpeg, size, rgba, 0, 0, 0, TJPF_RGBA, TJFLAG_FASTDCT|TJFLAG_FASTUPSAMPLE) == -1) {
-		fprintf(stderr, "DXT1: Could not decode image for '%s': %s\n", src, tjGetErrorStr());
-		free(jpeg);
-		free(rgba);
-		tjDestroy(tj);
+	int mips;
+	int totalsize = dxt1_header(width, height, &mips, dst);
+	int owned = convert_begin(*dst, totalsize, sizeof(DDS_HEADER));
+	unsigned char* dstpos = *dst + sizeof(DDS_HEADER);
+	
+	int origwidth = width, origheight = height;
+	int yuv = yuv_usable(subsamp, colourspace, width, height);
+	jpg_restarts restarts;
+	std::vector<jpg_band> bands;
+	if (yuv && config.threads > 1 && jpg_find_restarts(jpeg, size, width, height, &restarts)) {
+		jpg_plan_bands(&restarts, width, height, config.threads * 2, &bands);
+	}
+	int parallel = bands.size() > 1;
+	unsigned char* planes[3] = { NULL, NULL, NULL };
+	int strides[3];
+	unsigned char* rgba;
+	int ok = 1;
+	if (parallel) {
+		// Each band is decoded along with its encode below.
+		rgba = (unsigned char*)bufpool_get(PADDED(width >> 1) * PADDED(height >> 1) * 4);
+	} else if (yuv) {
+		// Padded, since the converter reads whole 16 pixel steps.
+		for (int i = 0; i < 3; i++) {
+			strides[i] = tjPlaneWidth(i, width, subsamp);
+			planes[i] = (unsigned char*)bufpool_get(strides[i] * tjPlaneHeight(i, height, subsamp) + 16);
+		}
+		rgba = (unsigned char*)bufpool_get(PADDED(width >> 1) * PADDED(height >> 1) * 4);
+		ok = tjDecompressToYUVPlanes(tj, jpeg, size, planes, 0, strides, 0, TJFLAG_FASTDCT) != -1;
+	} else {
+		rgba = (unsigned char*)bufpool_get(PADDED(width) * PADDED(height) * 4);
+		ok = tjDecompress2(tj, jpeg, size, rgba, 0, PADDED(width) * 4, 0, TJPF_RGBA, TJFLAG_FASTDCT|TJFLAG_FASTUPSAMPLE) != -1;
+	}
+	if (!ok) {
+		fprintf(stderr, "DXT1: Could not decode image for '%s': %s\n", src, tjGetErrorStr2(tj));
+		bufpool_put(jpeg);
+		bufpool_put(rgba);
+		for (int i = 0; i < 3; i++) bufpool_put(planes[i]);
+		if (!owned) bufpool_put(*dst);
+		*dst = NULL;
 		return -1;
 	}
-	free(jpeg);
-	tjDestroy(tj);
 	
 	if (DEBUG) {
 		ftime(&mid);
 		int diff = (1000.0 * (mid.time - start.time) + (mid.millitm - start.millitm));
-		printf("DXT1: JPEG decode done in %d ms.\n", diff);
+		if (parallel) printf("DXT1: Decoding %d bands between restart markers.\n", (int)bands.size());
+		else printf("DXT1: JPEG %s decode done in %d ms.\n", yuv ? "YUV" : "RGBA", diff);
 	}
 
-	DDS_HEADER header;
-	memset(&header, 0, sizeof(header));
-	header.dwMagic = 0x20534444;
-	header.dwSize = 124;
-	header.dwFlags = 0x1 | 0x2 | 0x4 | 0x1000;
-	header.dwHeight = height;
-	header.dwWidth = width;
-	header.dwCaps = 0x1000;
-	
-	int mips = 0;
-	int totalsize = sizeof(header);
-	while ((height >> mips) >= MINSIZE && (width >> mips) >= MINSIZE) {
-		totalsize += (height >> mips) * (width >> mips) / 2;
-		mips++;
-	}
-	if (DEBUG) printf("DXT1: Allocating %d bytes for %d mip%s from %dx%d.\n", totalsize, mips, mips==1?"":"s", width, height);
-	header.dwFlags |= 0x20000;
-	header.dwMipMapCount = mips;
-	header.dwCaps |= 0x8 | 0x400000;
-	
-	DDS_PIXELFORMAT ddspix;
-	memset(&ddspix, 0, sizeof(ddspix));
-	ddspix.dwSize = 32;
-	ddspix.dwFlags = 0x4;
-	ddspix.dwFourCC = 'D' | 'X'<<8 | 'T'<<16 | '1'<<24;
-	header.ddspf = ddspix;
-
-	*dst = (unsigned char*)memalign(16, totalsize);
-	unsigned char* dstpos = *dst;
-
-	memcpy(dstpos, &header, sizeof(header));
-	dstpos += sizeof(header);
-
+	// Every lower level fits in the space of the first one, so the two buffers
+	// are swapped back and forth instead of allocating one per level.
+	unsigned char* nextmip = (unsigned char*)bufpool_get(PADDED(width >> 1) * PADDED(height >> 1) * 4);
 	int bytes;
-	CompressImageDXT1(rgba, dstpos, width, height, bytes);
+	int halved = 0;
+	if (parallel) {
+		halved = mips > 1;
+		bytes = jpg_dxt1_bands(jpeg, &restarts, &bands, subsamp, width, height, dstpos, halved ? nextmip : NULL, *dst);
+		if (bytes == -1) {
+			fprintf(stderr, "DXT1: Could not decode image for '%s'.\n", src);
+			bufpool_put(jpeg);
+			bufpool_put(rgba);
+			bufpool_put(nextmip);
+			if (!owned) bufpool_put(*dst);
+			*dst = NULL;
+			return -1;
+		}
+		if (halved) padimage(nextmip, width >> 1, height >> 1);
+	} else if (yuv) {
+		// Level 1 comes out of the converter too. A scaled decode may still replace
+		// it, but this is what's left if that fails.
+		halved = mips > 1;
+		bytes = jpg_dxt1_yuv(planes, strides, subsamp, width, height, dstpos, halved ? nextmip : NULL, config.threads, *dst);
+		if (halved) padimage(nextmip, width >> 1, height >> 1);
+		for (int i = 0; i < 3; i++) bufpool_put(planes[i]);
+	} else {
+		padimage(rgba, width, height);
+		halved = mips > 1 && !dct_level(width, height, 1);
+		bytes = convert_compress(rgba, dstpos, width, height, FORMAT_DXT1, halved ? nextmip : NULL, *dst);
+	}
 	dstpos += bytes;
 
-	int curmip = 0;
-	if (mips > 0) {
-		while (width > MINSIZE && height > MINSIZE) {
-			if (DEBUG >= 2) printf("DXT1: Resample mip %d (%d x %d)\n", ++curmip, width, height);
-			unsigned char* nextmip = (unsigned char*)memalign(16, width * height * 4);
-			halveimage(rgba, width, height, nextmip);
-			width >>= 1;
-			height >>= 1;
-			free(rgba);
-			rgba = nextmip;
-			
-			if (DEBUG >= 2) printf("DXT1: Compress mip %d (%d x %d)\n", curmip, width, height);
-			CompressImageDXT1(rgba, dstpos, width, height, bytes);
-			dstpos += bytes;
-			if (DEBUG >= 2) printf("DXT1: Done mip %d.\n", curmip);
+	int mipms = 0;
+	for (int curmip = 1; curmip < mips; curmip++) {
+		struct timeb mipstart, mipend;
+		if (DEBUG) ftime(&mipstart);
+		
+		int scaled = dct_level(origwidth, origheight, curmip);
+		if (scaled) {
+			// Let the IDCT produce this level straight from the source at 1/2, 1/4 or 1/8 scale.
+			if (DEBUG >= 2) printf("DXT1: Scaled decode mip %d (%d x %d)\n", curmip, width >> 1, height >> 1);
+			if (tjDecompress2(tj, jpeg, size, nextmip, width >> 1, PADDED(width >> 1) * 4, height >> 1, TJPF_RGBA, TJFLAG_FASTDCT|TJFLAG_FASTUPSAMPLE) == -1) {
+				fprintf(stderr, "DXT1: Scaled decode of mip %d failed for '%s', resampling instead: %s\n", curmip, src, tjGetErrorStr2(tj));
+				scaled = 0;
+			} else {
+				padimage(nextmip, width >> 1, height >> 1);
+			}
 		}
+		if (!scaled && !halved) {
+			if (DEBUG >= 2) printf("DXT1: Resample mip %d (%d x %d)\n", curmip, width, height);
+			shrinkimage(rgba, width, height, nextmip);
+		}
+		width >>= 1;
+		height >>= 1;
+		std::swap(rgba, nextmip);
+		
+		if (DEBUG) {
+			ftime(&mipend);
+			mipms += (1000.0 * (mipend.time - mipstart.time) + (mipend.millitm - mipstart.millitm));
+		}
+		
+		// Halve into the next level during the encode, unless the IDCT is making it.
+		halved = curmip + 1 < mips && !dct_level(origwidth, origheight, curmip + 1);
+		if (DEBUG >= 2) printf("DXT1: Compress mip %d (%d x %d)%s\n", curmip, width, height, halved ? " and resample" : "");
+		bytes = convert_compress(rgba, dstpos, width, height, FORMAT_DXT1, halved ? nextmip : NULL, *dst);
+		dstpos += bytes;
+		convert_progress(dstpos - *dst);
+		if (DEBUG >= 2) printf("DXT1: Done mip %d.\n", curmip);
 	}
 	
 	if (dstpos != *dst + totalsize) printf("Warning: Calculated size %d different from actual end offset %d!\n", totalsize, (int)(dstpos-*dst));
-	free(rgba);
+	bufpool_put(rgba);
+	bufpool_put(nextmip);
+	bufpool_put(jpeg);
 	
 	
 	if (DEBUG) {
 		ftime(&end);
 		int diff = (1000.0 * (end.time - mid.time) + (end.millitm - mid.millitm));
+		printf("DXT1: Mip generation (%s) took %d ms.\n", mipgen_names[config.mipgen], mipms);
 		printf("DXT1: DXT1 encode done in %d ms.\n", diff);
 		diff = (1000.0 * (end.time - start.time) + (end.millitm - start.millitm));
 		printf("DXT1: Total time %d ms.\n", diff);
@@ -186,17 +710,17 @@ int ddsfs_jpg_rgb(char* src, unsigned char** dst) {
 	}
 	
 	size_t size = lseek(fd, 0, SEEK_END);
-	unsigned char* jpeg = (unsigned char*)memalign(16, size);
+	unsigned char* jpeg = (unsigned char*)bufpool_get(size);
 	lseek(fd, 0, SEEK_SET);
 	size = read(fd, jpeg, size);
 	close(fd);
 
-	tjhandle tj = tjInitDecompress();
+	tjhandle tj = jpg_decoder();
 	
 	int width, height, subsamp, colourspace;
 	if (tjDecompressHeader3(tj, jpeg, size, &width, &height, &subsamp, &colourspace) == -1) {
-		fprintf(stderr, "RGB: Could not decode header for '%s': %s\n", src, tjGetErrorStr());
-		free(jpeg);
+		fprintf(stderr, "RGB: Could not decode header for '%s': %s\n", src, tjGetErrorStr2(tj));
+		bufpool_put(jpeg);
 		return -1;
 	}
 	
@@ -214,10 +738,8 @@ int ddsfs_jpg_rgb(char* src, unsigned char** dst) {
 	int mips = 0;
 	int totalsize = sizeof(header);
 	if (poweroftwo(width) && poweroftwo(height)) {
-		while ((height >> mips) >= MINSIZE && (width >> mips) >= MINSIZE) {
-			totalsize += (height >> mips) * (width >> mips) * 4;
-			mips++;
-		}
+		mips = dds_mips(width, height);
+		for (int i = 0; i < mips; i++) totalsize += (height >> i) * (width >> i) * 4;
 		if (DEBUG) printf("RGB: Allocating %d bytes for %d mip%s.\n", totalsize, mips, mips==1?"":"s");
 		header.dwFlags |= 0x20000;
 		header.dwMipMapCount = mips;
@@ -237,25 +759,26 @@ int ddsfs_jpg_rgb(char* src, unsigned char** dst) {
 	ddspix.dwBBitMask = 0x000000FF;
 	header.ddspf = ddspix;
 	
-	*dst = (unsigned char*)memalign(16, totalsize+16);
+	*dst = (unsigned char*)bufpool_get(totalsize+16);
 	unsigned char* dstpos = *dst;
 
 	memcpy(dstpos, &header, sizeof(header));
 	dstpos += sizeof(header);
+	int owned = convert_begin(*dst, totalsize, sizeof(header));
 	
 	
 	// Decompress straight into the output buffer.
 	if (tjDecompress2(tj, jpeg, size, dstpos, 0, 0, 0, TJPF_BGRA, TJFLAG_FASTDCT|TJFLAG_FASTUPSAMPLE) == -1) {
-		fprintf(stderr, "RGB: Could not decode image for '%s': %s\n", src, tjGetErrorStr());
-		free(jpeg);
-		free(*dst);
+		fprintf(stderr, "RGB: Could not decode image for '%s': %s\n", src, tjGetErrorStr2(tj));
+		bufpool_put(jpeg);
+		if (!owned) bufpool_put(*dst);
 		(*dst) = 0;
 		return -1;
 	}
-	free(jpeg);
+	bufpool_put(jpeg);
 	int bytes = width * height * 4;
 	dstpos += bytes;	
-	tjDestroy(tj);
+	convert_progress(dstpos - *dst);
 	
 	if (DEBUG) {
 		ftime(&mid);
@@ -264,17 +787,15 @@ int ddsfs_jpg_rgb(char* src, unsigned char** dst) {
 	}
 
 
-	if (mips > 0) {
-		int curmip = 0;
-		while (width > MINSIZE && height > MINSIZE) {
-			if (DEBUG >= 2) printf("RGB: Resample mip %d (%d x %d)\n", ++curmip, width, height);
-			halveimage(dstpos-bytes, width, height, dstpos);
-			width >>= 1;
-			height >>= 1;
-			bytes = width * height * 4;
-			dstpos += bytes;
-			if (DEBUG >= 2) printf("RGB: Done mip %d.\n", curmip);
-		}
+	for (int curmip = 1; curmip < mips; curmip++) {
+		if (DEBUG >= 2) printf("RGB: Resample mip %d (%d x %d)\n", curmip, width, height);
+		halveimage(dstpos-bytes, width, height, dstpos);
+		width >>= 1;
+		height >>= 1;
+		bytes = width * height * 4;
+		dstpos += bytes;
+		convert_progress(dstpos - *dst);
+		if (DEBUG >= 2) printf("RGB: Done mip %d.\n", curmip);
 	}
 	
 	if (DEBUG >= 2) printf("RGB: Wrote a total of %d bytes.\n", (int)(dstpos-(*dst)));
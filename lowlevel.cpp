@@ -0,0 +1,460 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#if USE_FUSE3
+#define FUSE_USE_VERSION 35
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse_lowlevel.h>
+#include <vector>
+#include "ddsfs.h"
+using namespace std;
+
+// FUSE 3's low-level API names inodes instead of paths. Each one the kernel
+// has looked up is a Node, which keeps what the lookup found, so requests on
+// it don't need a path built by libfuse and taken apart again here.
+// Directories hold a descriptor, and names in them are looked up relative to
+// it. A Node's address is its inode number.
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+struct Node {
+	Node* parent;
+	string name;	// In parent.
+	string path;	// From the mount root, which is what the caches go by.
+	string rwpath;	// In the source path.
+	int fd;			// Directories only, otherwise -1.
+	uint64_t refs;	// Kernel lookups, plus one for each child.
+	// Guarded by nodelock.
+	int type;		// SRC_ type it's converted from, or -1.
+	string src;
+	struct stat st;
+	int fresh;		// st can be given without looking, only with -o watch.
+	unsigned int changes;
+};
+
+typedef vector<pair<string, struct stat>> Listing;
+
+static pthread_mutex_t nodelock = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<string, Node*> nodepaths;
+static Node root;
+static struct fuse_session* session = NULL;
+
+static Node* node_get(fuse_ino_t ino) {
+	return ino == FUSE_ROOT_ID ? &root : (Node*)(uintptr_t)ino;
+}
+
+static fuse_ino_t node_ino(Node* node) {
+	return node == &root ? FUSE_ROOT_ID : (fuse_ino_t)(uintptr_t)node;
+}
+
+// Where node is looked at from: its name in its parent's directory, or its
+// whole path if that couldn't be opened.
+static int node_at(const Node* node, const char** name) {
+	if (node->parent && node->parent->fd != -1) {
+		*name = node->name.c_str();
+		return node->parent->fd;
+	}
+	*name = node->rwpath.c_str();
+	return AT_FDCWD;
+}
+
+// Attributes can only be kept while -o watch will say when they change. Sizes
+// of converted files are only right with -o size until they're opened.
+static int node_keepable(int type) {
+	return config.watch && (type == -1 || config.size);
+}
+
+// Keeps what a lookup of node found. Call with nodelock held.
+static void node_set(Node* node, int type, const char* srcpath, const struct stat* st) {
+	node->type = type;
+	node->src = type == -1 ? "" : srcpath;
+	node->st = *st;
+	node->fresh = node_keepable(type);
+}
+
+// Finds or makes the node for name in dir, and counts a lookup of it.
+static Node* node_add(Node* dir, const char* name, const string& path, const string& rwpath, int type, const char* srcpath, const struct stat* st) {
+	int fd = -1;
+	if (S_ISDIR(st->st_mode)) {
+		const char* at = name;
+		if (dir->fd == -1) at = rwpath.c_str();
+		fd = openat(dir->fd == -1 ? AT_FDCWD : dir->fd, at, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+
+	pthread_mutex_lock(&nodelock);
+	Node* node = NULL;
+	auto i = nodepaths.find(path);
+	// Something of another kind there is a new node. The old one lasts until the kernel forgets it.
+	if (i != nodepaths.end() && (i->second->st.st_mode & S_IFMT) == (st->st_mode & S_IFMT)) node = i->second;
+	if (node) {
+		node->refs++;
+	} else {
+		node = new Node;
+		node->parent = dir;
+		dir->refs++;
+		node->name = name;
+		node->path = path;
+		node->rwpath = rwpath;
+		node->fd = fd;
+		node->refs = 1;
+		node->changes = 0;
+		nodepaths[path] = node;
+	}
+	node_set(node, type, srcpath, st);
+	pthread_mutex_unlock(&nodelock);
+
+	if (fd != -1 && node->fd != fd) close(fd);
+	return node;
+}
+
+// Drops count lookups of node, freeing it and any parents left unused.
+static void node_forget(Node* node, uint64_t count) {
+	pthread_mutex_lock(&nodelock);
+	while (node != &root && (node->refs -= count) == 0) {
+		auto i = nodepaths.find(node->path);
+		if (i != nodepaths.end() && i->second == node) nodepaths.erase(i);
+		if (node->fd != -1) close(node->fd);
+		Node* parent = node->parent;
+		delete node;
+		node = parent;
+		count = 1;
+	}
+	pthread_mutex_unlock(&nodelock);
+}
+
+static void lowlevel_init(void* userdata, struct fuse_conn_info* conn)
+{
+	// Lets reads of real files be spliced from their descriptors.
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+	dirindex_start();
+	watch_start();
+}
+
+static void lowlevel_destroy(void* userdata)
+{
+	prefetch_save();
+}
+
+static void lowlevel_lookup(fuse_req_t req, fuse_ino_t parent, const char* name)
+{
+	Node* dir = node_get(parent);
+	string path = dir == &root ? "/" + string(name) : dir->path + "/" + name;
+	string rwpath = config.basepath + path;
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.attr_timeout = config.attr_timeout;
+	e.entry_timeout = config.entry_timeout;
+
+	int res = -ENOENT;
+	int type = -1;
+	char srcpath[rwpath.size()+8];
+	if (!negcache_has(rwpath.c_str())) {
+		const char* at = name;
+		if (dir->fd == -1) at = rwpath.c_str();
+		res = ddsfs_lookup(path.c_str(), rwpath.c_str(), dir->fd == -1 ? AT_FDCWD : dir->fd, at, &e.attr, &type, srcpath);
+		if (res == -ENOENT) negcache_add(rwpath.c_str());
+	}
+	if (res == -ENOENT && config.negative_timeout > 0) {
+		// An entry with no inode is a miss the kernel keeps for entry_timeout.
+		e.entry_timeout = config.negative_timeout;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	Node* node = node_add(dir, name, path, rwpath, type, srcpath, &e.attr);
+	e.ino = node_ino(node);
+	if (fuse_reply_entry(req, &e) != 0) node_forget(node, 1);
+}
+
+static void lowlevel_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	node_forget(node_get(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void lowlevel_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets)
+{
+	for (size_t i = 0; i < count; i++) node_forget(node_get(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void lowlevel_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	Node* node = node_get(ino);
+	struct stat st;
+
+	pthread_mutex_lock(&nodelock);
+	int fresh = node->fresh;
+	unsigned int changes = node->changes;
+	if (fresh) st = node->st;
+	pthread_mutex_unlock(&nodelock);
+
+	if (!fresh) {
+		const char* name;
+		int at = node_at(node, &name);
+		int type;
+		char srcpath[node->rwpath.size()+8];
+		int res = ddsfs_lookup(node->path.c_str(), node->rwpath.c_str(), at, name, &st, &type, srcpath);
+		if (res < 0) {
+			fuse_reply_err(req, -res);
+			return;
+		}
+		pthread_mutex_lock(&nodelock);
+		// Unless -o watch saw it change while this was looking.
+		if (node->changes == changes) node_set(node, type, srcpath, &st);
+		pthread_mutex_unlock(&nodelock);
+	}
+	fuse_reply_attr(req, &st, config.attr_timeout);
+}
+
+static void lowlevel_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	Node* node = node_get(ino);
+	pthread_mutex_lock(&nodelock);
+	// Converted files can be read if their source can.
+	string file = node->type == -1 ? node->rwpath : node->src;
+	pthread_mutex_unlock(&nodelock);
+
+	fuse_reply_err(req, access(file.c_str(), mask) == -1 ? errno : 0);
+}
+
+static void lowlevel_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	Node* node = node_get(ino);
+	const char* name;
+	int at = node_at(node, &name);
+
+	pthread_mutex_lock(&nodelock);
+	int type = node->type;
+	string src = node->src;
+	pthread_mutex_unlock(&nodelock);
+
+	int res = ddsfs_openfile(node->path.c_str(), node->rwpath.c_str(), at, name, fi->flags, type, src.c_str());
+	if (res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fi->fh = res;
+	// -o watch tells the kernel when a file changes, so what it has read can be kept until then.
+	fi->keep_cache = config.watch;
+	if (fuse_reply_open(req, fi) != 0) ddsfs_close(res);
+}
+
+static void lowlevel_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+	if (fi->fh >= MEMCACHE_FDBASE) {
+		char* buf = (char*)malloc(size);
+		if (!buf) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		int res = memcache_read(fi->fh, buf, size, off);
+		if (res < 0) fuse_reply_err(req, -res);
+		else fuse_reply_buf(req, buf, res);
+		free(buf);
+		return;
+	}
+
+	// Real files are handed over as a descriptor, so libfuse can splice them.
+	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+	buf.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	buf.buf[0].fd = fi->fh;
+	buf.buf[0].pos = off;
+	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void lowlevel_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	if (DEBUG >= 2) printf("release: %s\n", node_get(ino)->rwpath.c_str());
+	ddsfs_close(fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static int lowlevel_listed(void* arg, const char* name, const struct stat* st)
+{
+	Listing* l = (Listing*)arg;
+	struct stat empty;
+	if (!st) {
+		memset(&empty, 0, sizeof(empty));
+		empty.st_mode = S_IFDIR;
+		st = &empty;
+	}
+	l->push_back(make_pair(string(name), *st));
+	return 0;
+}
+
+// The whole directory is read at opendir, and readdir hands it out a bufferful at a time.
+static void lowlevel_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	Node* node = node_get(ino);
+	Listing* l = new Listing;
+	int res = ddsfs_list(node->path.c_str(), node->rwpath.c_str(), node->fd == -1 ? AT_FDCWD : node->fd, lowlevel_listed, l);
+	if (res < 0) {
+		delete l;
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fi->fh = (uintptr_t)l;
+	// -o watch tells the kernel when the directory changes.
+	fi->keep_cache = config.watch;
+	fi->cache_readdir = config.watch;
+	if (fuse_reply_open(req, fi) != 0) delete l;
+}
+
+static void lowlevel_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi)
+{
+	Listing* l = (Listing*)(uintptr_t)fi->fh;
+	char* buf = (char*)malloc(size);
+	if (!buf) {
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+
+	size_t used = 0;
+	for (size_t i = off; i < l->size(); i++) {
+		size_t len = fuse_add_direntry(req, buf + used, size - used, (*l)[i].first.c_str(), &(*l)[i].second, i + 1);
+		if (len > size - used) break;
+		used += len;
+	}
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void lowlevel_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi)
+{
+	delete (Listing*)(uintptr_t)fi->fh;
+	fuse_reply_err(req, 0);
+}
+
+// Tells the kernel path, relative to the mount root, has changed, so it looks it
+// up and reads it again. For -o watch.
+void lowlevel_invalidate(const char* path)
+{
+	struct fuse_session* se = session;
+	if (!se) return;
+	const char* name = strrchr(path, '/');
+	if (!name || !name[1]) {
+		fuse_lowlevel_notify_inval_inode(se, FUSE_ROOT_ID, 0, 0);
+		return;
+	}
+	string dir(path, name - path);
+	name++;
+
+	fuse_ino_t parent = 0, ino = 0;
+	pthread_mutex_lock(&nodelock);
+	auto i = nodepaths.find(path);
+	if (i != nodepaths.end()) {
+		i->second->fresh = 0;
+		i->second->changes++;
+		ino = node_ino(i->second);
+	}
+	if (dir.empty()) parent = FUSE_ROOT_ID;
+	else if ((i = nodepaths.find(dir)) != nodepaths.end()) parent = node_ino(i->second);
+	pthread_mutex_unlock(&nodelock);
+
+	// Either may be gone from the kernel by now, which it ignores.
+	if (ino) fuse_lowlevel_notify_inval_inode(se, ino, 0, 0);
+	if (parent) fuse_lowlevel_notify_inval_entry(se, parent, name, strlen(name));
+}
+
+// Mounts and serves requests until unmounted. args are what's left after ddsfs's own options.
+int lowlevel_main(struct fuse_args* args)
+{
+	struct fuse_lowlevel_ops ops;
+	memset(&ops, 0, sizeof(ops));
+	ops.init = lowlevel_init;
+	ops.destroy = lowlevel_destroy;
+	ops.lookup = lowlevel_lookup;
+	ops.forget = lowlevel_forget;
+	ops.forget_multi = lowlevel_forget_multi;
+	ops.getattr = lowlevel_getattr;
+	ops.access = lowlevel_access;
+	ops.open = lowlevel_open;
+	ops.read = lowlevel_read;
+	ops.release = lowlevel_release;
+	ops.opendir = lowlevel_opendir;
+	ops.readdir = lowlevel_readdir;
+	ops.releasedir = lowlevel_releasedir;
+
+	struct fuse_cmdline_opts opts;
+	if (fuse_parse_cmdline(args, &opts) != 0) return 1;
+	if (opts.show_version) {
+		printf("FUSE library version %s\n", fuse_pkgversion());
+		fuse_lowlevel_version();
+		return 0;
+	}
+	if (!opts.mountpoint) {
+		fprintf(stderr, "Usage: %s <scenery> <mount>\n", args->argv[0]);
+		return 1;
+	}
+
+	root.parent = NULL;
+	root.name = "";
+	root.path = "/";
+	root.rwpath = string(config.basepath) + "/";
+	root.refs = 1;
+	root.type = -1;
+	root.fresh = 0;
+	root.changes = 0;
+	root.fd = open(config.basepath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (root.fd == -1) {
+		fprintf(stderr, "Could not open '%s'.\n", config.basepath);
+		free(opts.mountpoint);
+		return 1;
+	}
+
+	int ret = 1;
+	struct fuse_session* se = fuse_session_new(args, &ops, sizeof(ops), NULL);
+	if (se) {
+		if (fuse_set_signal_handlers(se) == 0) {
+			if (fuse_session_mount(se, opts.mountpoint) == 0) {
+				fuse_daemonize(opts.foreground);
+				session = se;
+				if (opts.singlethread) {
+					ret = fuse_session_loop(se);
+				} else {
+					struct fuse_loop_config loop;
+					loop.clone_fd = opts.clone_fd;
+					loop.max_idle_threads = opts.max_idle_threads;
+					ret = fuse_session_loop_mt(se, &loop);
+				}
+				session = NULL;
+				fuse_session_unmount(se);
+			}
+			fuse_remove_signal_handlers(se);
+		}
+		fuse_session_destroy(se);
+	}
+	free(opts.mountpoint);
+	close(root.fd);
+	return ret ? 1 : 0;
+}
+#endif
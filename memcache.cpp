@@ -21,6 +21,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <list>
+#include <atomic>
 #include "ddsfs.h"
 using namespace std;
 
@@ -30,26 +31,43 @@ public:
 	unsigned char* data;
 	unsigned int len;
 	int refs;
+	// Bytes from the start of data which are valid. Less than len while a
+	// progressive conversion is still filling the buffer in. Stored with
+	// release after the bytes are written, so readers loading it with
+	// acquire see them.
+	std::atomic<unsigned int> ready;
+	int failed;
+	int waiters;
+	pthread_cond_t cond;
 	
 	CacheEntry(const char* n, unsigned char* d, unsigned int l) {
 		name = n;
 		data = d;
 		len = l;
 		refs = 1;
+		ready = l;
+		failed = 0;
+		waiters = 0;
+		pthread_cond_init(&cond, NULL);
 	}
 	CacheEntry(const string& n, unsigned char* d, unsigned int l) {
 		name = n;
 		data = d;
 		len = l;
 		refs = 1;
+		ready = l;
+		failed = 0;
+		waiters = 0;
+		pthread_cond_init(&cond, NULL);
 	}
 	~CacheEntry() {
 		if (refs > 1) fprintf(stderr, "Warning: Deleting memory-cached file with %d refs!\n", refs);
-		if (data) free(data);
+		bufpool_put(data);
+		pthread_cond_destroy(&cond);
 	}
 };
 
-static int nextfd = 100;
+static int nextfd = MEMCACHE_FDBASE;
 
 static unordered_map<int,CacheEntry*>* memcache = new unordered_map<int,CacheEntry*>();
 static unordered_map<string,CacheEntry*>* memindex = new unordered_map<string,CacheEntry*>();
@@ -58,6 +76,8 @@ static pthread_rwlock_t cachelock;
 static list<string>* memlru = new list<string>();
 static pthread_mutex_t lrulock = PTHREAD_MUTEX_INITIALIZER;
 
+static pthread_mutex_t progresslock = PTHREAD_MUTEX_INITIALIZER;
+
 static void lru_tidy() {
 	list<string>::iterator i;
 	CacheEntry* j;
@@ -67,11 +87,14 @@ static void lru_tidy() {
 		do {
 			if (i == memlru->end()) return;
 
-			j = memindex->at(*i);
-			if (j == NULL) {
-				fprintf(stderr, "Error: Tidy found LRU list item '%s' which isn't in index.\n", i->c_str());
+			auto k = memindex->find(*i);
+			if (k == memindex->end()) {
+				// Failed conversions are dropped from the index, just forget them here too.
+				if (DEBUG) printf("memcache: Tidy found LRU list item '%s' which isn't in index.\n", i->c_str());
+				j = NULL;
 				break;
 			}
+			j = k->second;
 			if (j->refs == 0) break;
 
 			i++;
@@ -86,6 +109,8 @@ static void lru_tidy() {
 	}
 }
 static void lru_hit(const string& name) {
+	// Only cache=# keeps unreferenced files around, the other modes free them on release.
+	if (config.cache < CACHE_MEM) return;
 	pthread_mutex_lock(&lrulock);
 
 	for (auto i = memlru->begin(); i != memlru->end(); i++) {
@@ -109,7 +134,7 @@ static int memcache_nextfd() {
 	int fd;
 	do {
 		fd = nextfd++;
-		if (nextfd > 1000000) nextfd = 100;
+		if (nextfd > MEMCACHE_FDBASE + 1000000) nextfd = MEMCACHE_FDBASE;
 	} while (memcache->find(fd) != memcache->end());
 	return fd;
 }
@@ -132,35 +157,134 @@ int memcache_getfd(const string& name) {
 	return fd;
 }
 
-int memcache_store(const string& name, unsigned char* dds, unsigned int len) {
+// Whether name is in the cache, without taking a reference to it.
+int memcache_has(const string& name) {
+	pthread_rwlock_rdlock(&cachelock);
+	int ret = memindex->find(name) != memindex->end();
+	pthread_rwlock_unlock(&cachelock);
+	return ret;
+}
+
+// Drops name from the index, so the next open converts it again. Handles
+// which are already open keep reading what they have.
+void memcache_forget(const string& name) {
+	pthread_rwlock_wrlock(&cachelock);
+	auto i = memindex->find(name);
+	if (i != memindex->end()) {
+		CacheEntry* ce = i->second;
+		memindex->erase(i);
+		if (DEBUG) printf("memcache: Forgot '%s'.\n", name.c_str());
+		// The LRU list skips names which aren't in the index any more.
+		if (ce->refs == 0) delete ce;
+	}
+	pthread_rwlock_unlock(&cachelock);
+}
+
+static int memcache_add(const string& name, unsigned char* dds, unsigned int len, unsigned int ready) {
 	pthread_rwlock_wrlock(&cachelock);
 
 	CacheEntry* ce = new CacheEntry(name, dds, len);
+	ce->ready = ready;
 	int fd = memcache_nextfd();
 	
 	memcache->emplace(fd, ce);
-	memindex->emplace(name, ce);
+	// A finished copy may still be held open while a new conversion replaces it.
+	(*memindex)[name] = ce;
 	lru_hit(name);
 	
 	pthread_rwlock_unlock(&cachelock);
 	return fd;
 }
 
-int memcache_read(int fd, char* buf, size_t size, off_t offset) {
-	pthread_rwlock_rdlock(&cachelock);
+int memcache_store(const string& name, unsigned char* dds, unsigned int len) {
+	return memcache_add(name, dds, len, len);
+}
+
+// Like memcache_store, but only the first ready bytes are valid yet. Reads past
+// that wait for memcache_progress or memcache_fail.
+int memcache_reserve(const string& name, unsigned char* dds, unsigned int len, unsigned int ready) {
+	return memcache_add(name, dds, len, ready);
+}
+
+// Another handle to the same entry as fd, for when it was never put in the index or may have been replaced.
+int memcache_dup(int fd) {
+	pthread_rwlock_wrlock(&cachelock);
+	int ret = 0;
 	
 	auto i = memcache->find(fd);
 	if (i != memcache->end()) {
-		if (size+offset > i->second->len) {
-			size = (i->second->len)-offset;
-			if (DEBUG) printf("read: Read would have exceeded length, reducing to %lu.\n", size);
-		}
-		memcpy(buf, (i->second->data)+offset, size);
-	} else {
-		size = -1;
+		ret = memcache_nextfd();
+		memcache->emplace(ret, i->second);
+		i->second->refs++;
 	}
 	
 	pthread_rwlock_unlock(&cachelock);
+	return ret;
+}
+
+// The caller holds a reference through fd, so the entry can't be deleted while
+// we use it outside of cachelock.
+static CacheEntry* memcache_entry(int fd) {
+	CacheEntry* ce = NULL;
+	pthread_rwlock_rdlock(&cachelock);
+	auto i = memcache->find(fd);
+	if (i != memcache->end()) ce = i->second;
+	pthread_rwlock_unlock(&cachelock);
+	return ce;
+}
+
+void memcache_progress(int fd, unsigned int ready) {
+	CacheEntry* ce = memcache_entry(fd);
+	if (!ce) return;
+	
+	pthread_mutex_lock(&progresslock);
+	ce->ready.store(ready, std::memory_order_release);
+	pthread_cond_broadcast(&ce->cond);
+	pthread_mutex_unlock(&progresslock);
+}
+
+void memcache_fail(int fd) {
+	CacheEntry* ce = memcache_entry(fd);
+	if (!ce) return;
+	
+	pthread_mutex_lock(&progresslock);
+	ce->failed = 1;
+	pthread_cond_broadcast(&ce->cond);
+	pthread_mutex_unlock(&progresslock);
+	
+	// Let the next open try again rather than finding the broken copy.
+	pthread_rwlock_wrlock(&cachelock);
+	auto i = memindex->find(ce->name);
+	if (i != memindex->end() && i->second == ce) memindex->erase(i);
+	pthread_rwlock_unlock(&cachelock);
+}
+
+const volatile int* memcache_waiters(int fd) {
+	CacheEntry* ce = memcache_entry(fd);
+	return ce ? &ce->waiters : NULL;
+}
+
+int memcache_read(int fd, char* buf, size_t size, off_t offset) {
+	CacheEntry* ce = memcache_entry(fd);
+	if (!ce) return -EBADF;
+	
+	if ((size_t)offset >= ce->len) return 0;
+	if (size+offset > ce->len) {
+		size = (ce->len)-offset;
+		if (DEBUG) printf("read: Read would have exceeded length, reducing to %lu.\n", size);
+	}
+	
+	if (ce->ready.load(std::memory_order_acquire) < size+offset) {
+		pthread_mutex_lock(&progresslock);
+		if (DEBUG >= 2 && ce->ready.load(std::memory_order_acquire) < size+offset) printf("read: Waiting for bytes %ld-%lu of '%s'.\n", offset, size+offset, ce->name.c_str());
+		ce->waiters++;
+		while (ce->ready.load(std::memory_order_acquire) < size+offset && !ce->failed) pthread_cond_wait(&ce->cond, &progresslock);
+		ce->waiters--;
+		pthread_mutex_unlock(&progresslock);
+		if (ce->ready.load(std::memory_order_acquire) < size+offset) return -EIO;
+	}
+	
+	memcpy(buf, (ce->data)+offset, size);
 	return size;
 }
 
@@ -170,10 +294,14 @@ int memcache_release(int fd) {
 	
 	auto i = memcache->find(fd);
 	if (i != memcache->end()) {
-		if (config.cache == CACHE_NONE && i->second->refs <= 1) {
-			if (DEBUG) printf("release: Freeing %d bytes of memory for FD %d.\n", i->second->len, i->first);
-			memindex->erase(i->second->name);
-			delete i->second;
+		CacheEntry* ce = i->second;
+		auto j = memindex->find(ce->name);
+		int indexed = (j != memindex->end() && j->second == ce);
+		// Entries which were failed or replaced in the index can't be found by the LRU any more.
+		if ((config.cache < CACHE_MEM || ce->failed || !indexed) && ce->refs <= 1) {
+			if (DEBUG) printf("release: Freeing %d bytes of memory for FD %d.\n", ce->len, i->first);
+			if (indexed) memindex->erase(j);
+			delete ce;
 		} else {
 			i->second->refs--;
 			if (DEBUG) printf("release: FD %d now has %d ref%s.\n", i->first, i->second->refs, i->second->refs==1?"":"s");
@@ -0,0 +1,73 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <libdxt.h>
+#include "ddsfs.h"
+
+// Each level only ever holds one strip of rows. When a strip fills up it is
+// encoded straight into the output, halved into the next level's strip, and
+// reused, so the working set is a few hundred KB regardless of image size.
+
+MipStream::MipStream(int width, int height, int mips, int alpha, unsigned char* dst) {
+	format = alpha ? FORMAT_DXT5 : FORMAT_DXT1;
+	count = mips > 0 ? mips : 1;
+	levels = new Level[count];
+	base = dst;
+
+	for (int i = 0; i < count; i++) {
+		Level& l = levels[i];
+		l.width = width >> i;
+		l.height = height >> i;
+		l.size = l.height < STRIPROWS ? l.height : STRIPROWS;
+		l.rows = 0;
+		l.strip = (unsigned char*)bufpool_get(l.width * l.size * 4);
+		l.out = dst;
+		dst += (l.width / 4) * (l.height / 4) * (alpha ? 16 : 8);
+	}
+}
+
+MipStream::~MipStream() {
+	for (int i = 0; i < count; i++) bufpool_put(levels[i].strip);
+	delete[] levels;
+}
+
+unsigned char* MipStream::rows() {
+	return levels[0].strip + levels[0].rows * levels[0].width * 4;
+}
+
+int MipStream::space() {
+	return levels[0].size - levels[0].rows;
+}
+
+void MipStream::commit(int rows) {
+	levels[0].rows += rows;
+	if (levels[0].rows == levels[0].size) flush(0);
+}
+
+void MipStream::flush(int level) {
+	Level& l = levels[level];
+
+	l.out += CompressDXT(l.strip, l.out, l.width, l.rows, format, config.threads);
+	if (level == 0) convert_progress(sizeof(DDS_HEADER) + (l.out - base));
+
+	if (level+1 < count) {
+		Level& next = levels[level+1];
+		halveimage(l.strip, l.width, l.rows, next.strip + next.rows * next.width * 4);
+		next.rows += l.rows / 2;
+		if (next.rows == next.size) flush(level+1);
+	}
+	l.rows = 0;
+}
@@ -0,0 +1,152 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ddsfs.h"
+using namespace std;
+
+// Names getattr found nothing for, so asking again costs a lookup here instead
+// of a stat for every source extension. X-Plane asks after plenty of files
+// which were never there. Entries last -o negcache seconds, and only while
+// their directory hasn't changed since. It's direct-mapped, so a new miss
+// just replaces whatever was in its slot.
+#define NEGSLOTS 65536
+#define DIRSLOTS 4096
+#define NEGSTRIPES 16
+
+struct NegSlot {
+	uint64_t key;
+	uint64_t dir;
+	int64_t mtime;		// The directory's, when the miss was seen.
+	int64_t expires;
+};
+
+struct DirSlot {
+	uint64_t key;
+	int64_t mtime;
+	int64_t checked;
+};
+
+static NegSlot negslots[NEGSLOTS];
+static DirSlot dirslots[DIRSLOTS];
+static pthread_mutex_t neglocks[NEGSTRIPES];
+static pthread_mutex_t dirlocks[NEGSTRIPES];
+static pthread_once_t negonce = PTHREAD_ONCE_INIT;
+
+static void negcache_init() {
+	for (int i = 0; i < NEGSTRIPES; i++) {
+		pthread_mutex_init(&neglocks[i], NULL);
+		pthread_mutex_init(&dirlocks[i], NULL);
+	}
+}
+
+// Modification time of the directory rwpath is in, in nanoseconds, from a
+// stat at most DIRCHECK old. Returns -1 if it can't be read.
+static int64_t negcache_dirtime(const char* rwpath, uint64_t* dirkey, int64_t now) {
+	const char* end = strrchr(rwpath, '/');
+	size_t len = end ? end - rwpath : 0;
+	uint64_t key = fnv1a(rwpath, len);
+	*dirkey = key;
+
+	DirSlot* slot = &dirslots[key % DIRSLOTS];
+	pthread_mutex_t* lock = &dirlocks[key % NEGSTRIPES];
+	pthread_mutex_lock(lock);
+	if (slot->key == key && now - slot->checked < DIRCHECK) {
+		int64_t mtime = slot->mtime;
+		pthread_mutex_unlock(lock);
+		return mtime;
+	}
+	pthread_mutex_unlock(lock);
+
+	char dir[len+2];
+	memcpy(dir, rwpath, len);
+	if (len == 0) dir[len++] = '/';
+	dir[len] = 0;
+	struct stat st;
+	if (stat(dir, &st) == -1) return -1;
+	int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	pthread_mutex_lock(lock);
+	slot->key = key;
+	slot->mtime = mtime;
+	slot->checked = now;
+	pthread_mutex_unlock(lock);
+	return mtime;
+}
+
+// Whether getattr already found nothing at rwpath.
+int negcache_has(const char* rwpath) {
+	if (!config.negcache) return 0;
+	pthread_once(&negonce, negcache_init);
+	uint64_t key = fnv1a(rwpath, strlen(rwpath));
+	NegSlot* slot = &negslots[key % NEGSLOTS];
+	pthread_mutex_t* lock = &neglocks[key % NEGSTRIPES];
+	int64_t now = monotonic_ns();
+
+	pthread_mutex_lock(lock);
+	int found = slot->key == key && slot->expires > now;
+	uint64_t dir = slot->dir;
+	int64_t mtime = slot->mtime;
+	pthread_mutex_unlock(lock);
+	if (!found) return 0;
+
+	uint64_t dirkey;
+	if (negcache_dirtime(rwpath, &dirkey, now) != mtime || dirkey != dir) {
+		pthread_mutex_lock(lock);
+		if (slot->key == key) slot->key = 0;
+		pthread_mutex_unlock(lock);
+		return 0;
+	}
+	if (DEBUG >= 3) printf("negcache: '%s' is known not to exist.\n", rwpath);
+	return 1;
+}
+
+// Remembers that getattr found nothing at rwpath.
+void negcache_add(const char* rwpath) {
+	if (!config.negcache) return;
+	pthread_once(&negonce, negcache_init);
+	int64_t now = monotonic_ns();
+	uint64_t dir;
+	int64_t mtime = negcache_dirtime(rwpath, &dir, now);
+	if (mtime == -1) return;
+
+	uint64_t key = fnv1a(rwpath, strlen(rwpath));
+	NegSlot* slot = &negslots[key % NEGSLOTS];
+	pthread_mutex_t* lock = &neglocks[key % NEGSTRIPES];
+	pthread_mutex_lock(lock);
+	slot->key = key;
+	slot->dir = dir;
+	slot->mtime = mtime;
+	slot->expires = now + (int64_t)config.negcache * 1000000000LL;
+	pthread_mutex_unlock(lock);
+}
+
+// Forgets that getattr found nothing at rwpath, for when it's just been created.
+void negcache_forget(const char* rwpath) {
+	if (!config.negcache) return;
+	pthread_once(&negonce, negcache_init);
+	uint64_t key = fnv1a(rwpath, strlen(rwpath));
+	NegSlot* slot = &negslots[key % NEGSLOTS];
+	pthread_mutex_t* lock = &neglocks[key % NEGSTRIPES];
+	pthread_mutex_lock(lock);
+	if (slot->key == key) slot->key = 0;
+	pthread_mutex_unlock(lock);
+}
@@ -0,0 +1,428 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+#include "ddsfs.h"
+using namespace std;
+
+// Ortho4XP names each texture <row>_<col>_<provider><zoom>, where row and col
+// are its top-left tile at that zoom level and each texture is 16 tiles
+// across. X-Plane loads them a band of the map at a time, so when one is opened
+// the ones around it are converted in the background ready for the next band.
+#define TILESTEP 16
+
+// Splits a texture name into its tile coordinates and the part after them,
+// which is the same for all textures of one provider and zoom level.
+static int parse_tile(const char* name, int* row, int* col, const char** rest) {
+	char* end;
+	if (!isdigit(*name)) return 0;
+	*row = strtol(name, &end, 10);
+	if (*end != '_' || !isdigit(end[1])) return 0;
+	*col = strtol(end + 1, &end, 10);
+	if (*end != '_') return 0;
+	*rest = end + 1;
+
+	// The provider code may end in a digit itself, but the zoom level is always two.
+	const char* ext = strrchr(*rest, '.');
+	if (!ext || strcasecmp(ext, ".dds") || ext - *rest < 3) return 0;
+	return isdigit(ext[-1]) && isdigit(ext[-2]);
+}
+
+// Queues one texture in class prio unless there's nothing to do for it.
+// Returns 0 once the background queue is full.
+static int prefetch_one(const char* path, unsigned int bytes, int prio = CONVERT_PREFETCH) {
+	struct stat st;
+	char rwpath[config.basepathlen+strlen(path)+1];
+	sprintf(rwpath, "%s%s", config.basepath, path);
+
+	if (stat(rwpath, &st) == 0) return 1;
+	if (config.cachepath) {
+		char cpath[config.cachepathlen+strlen(path)+1];
+		sprintf(cpath, "%s%s", config.cachepath, path);
+		if (stat(cpath, &st) == 0) return 1;
+	}
+	if (memcache_has(rwpath)) return 1;
+
+	char srcpath[strlen(rwpath)+8];
+	int type = ddsfs_source(rwpath, srcpath);
+	if (type == -1) return 1;
+
+	int size = sizecache_get(rwpath);
+	int res = convert_queue(path, rwpath, srcpath, type, prio, size > 0 ? size : bytes);
+	if (res == 0 && DEBUG >= 2) printf("prefetch: Queued '%s'.\n", path);
+	return res != -ENOSPC && res != -ENOTSUP;
+}
+
+// Queues textures up to -o prefetch steps away from path, nearest first,
+// until -o bgmem is used up.
+static void prefetch_tiles(const char* path) {
+	if (config.prefetch == 0 || config.cache == CACHE_NONE) return;
+
+	const char* name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	int row, col;
+	const char* rest;
+	if (!parse_tile(name, &row, &col, &rest)) return;
+
+	// Neighbours are usually the same size as this one.
+	char rwpath[config.basepathlen+strlen(path)+1];
+	sprintf(rwpath, "%s%s", config.basepath, path);
+	int size = sizecache_get(rwpath);
+	unsigned int bytes = size > 0 ? size : dds_size(4096, 4096);
+
+	int dirlen = name - path;
+	char next[dirlen+strlen(rest)+32];
+	memcpy(next, path, dirlen);
+
+	for (int ring = 1; ring <= (int)config.prefetch; ring++) {
+		for (int dr = -ring; dr <= ring; dr++) {
+			for (int dc = -ring; dc <= ring; dc++) {
+				if (abs(dr) != ring && abs(dc) != ring) continue;
+				int r = row + dr * TILESTEP;
+				int c = col + dc * TILESTEP;
+				if (r < 0 || c < 0) continue;
+				sprintf(next + dirlen, "%d_%d_%s", r, c, rest);
+				if (!prefetch_one(next, bytes)) return;
+			}
+		}
+	}
+}
+
+// Resolves name, relative to the directory of path, into out. Handles the
+// ../ that .ter files use to get from terrain/ over to textures/.
+static int resolve(const char* path, const char* name, char* out, int size) {
+	const char* dir = strrchr(path, '/');
+	int len = dir ? dir - path : 0;
+	if (name[0] == '/' || len + strlen(name) + 2 > (size_t)size) return 0;
+	memcpy(out, path, len);
+
+	while (*name) {
+		const char* end = strchr(name, '/');
+		int part = end ? end - name : strlen(name);
+		if (part == 2 && !strncmp(name, "..", 2)) {
+			while (len > 0 && out[--len] != '/');
+		} else if (part && !(part == 1 && name[0] == '.')) {
+			out[len++] = '/';
+			memcpy(out + len, name, part);
+			len += part;
+		}
+		name += part;
+		if (*name) name++;
+	}
+	out[len] = 0;
+	return len > 0;
+}
+
+// Reads the .ter file at path. X-Plane opens the textures it names right
+// after reading it, so they're queued for conversion now.
+static void prefetch_terfile(const char* path) {
+	char rwpath[config.basepathlen+strlen(path)+1];
+	sprintf(rwpath, "%s%s", config.basepath, path);
+	int fd = open(rwpath, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return;
+
+	char buf[16384];
+	int len = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (len <= 0) return;
+	buf[len] = 0;
+
+	char tex[strlen(path) + sizeof(buf)];
+	char* save;
+	for (char* line = strtok_r(buf, "\r\n", &save); line; line = strtok_r(NULL, "\r\n", &save)) {
+		// Texture lines look like BASE_TEX_NOWRAP ../textures/x.dds, some with numbers before the file.
+		char* word = line + strspn(line, " \t");
+		if (strncmp(word, "BASE_TEX", 8) && strncmp(word, "BORDER_TEX", 10) && strncmp(word, "TEXTURE", 7)) continue;
+		char* end = word + strlen(word);
+		while (end > word && isspace(end[-1])) *--end = 0;
+		char* file = strrchr(word, ' ');
+		char* tab = strrchr(word, '\t');
+		if (tab > file) file = tab;
+		if (!file) continue;
+		file++;
+
+		const char* ext = strrchr(file, '.');
+		if (!ext || strcasecmp(ext, ".dds")) continue;
+		if (!resolve(path, file, tex, sizeof(tex))) continue;
+		if (!prefetch_one(tex, dds_size(4096, 4096))) return;
+	}
+}
+
+
+// With -o learn, each texture open is counted as following the one before it.
+// Pilots tend to fly the same routes, so the next time a texture is opened the
+// ones which followed it often enough before are queued right away. Counts
+// are kept across mounts in a file in the cache path.
+#define LEARNNEXT 4		// Successors kept for each texture.
+#define LEARNAGE 256	// Counts for a texture are halved once they add up to this.
+
+struct Successor {
+	string path;
+	unsigned int count;
+};
+
+static pthread_mutex_t learnlock = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<string, vector<Successor>> learned;
+static string lastopen;
+static string learnfile;
+
+static void learn_count(const string& from, const string& to, unsigned int count) {
+	vector<Successor>& next = learned[from];
+	auto i = next.begin();
+	while (i != next.end() && i->path != to) i++;
+	if (i != next.end()) {
+		i->count += count;
+	} else if (next.size() < LEARNNEXT) {
+		next.push_back({to, count});
+	} else {
+		// Only the most common successors are kept, a new one replaces the rarest.
+		auto least = std::min_element(next.begin(), next.end(), [](const Successor& a, const Successor& b) { return a.count < b.count; });
+		*least = {to, count};
+	}
+
+	unsigned int total = 0;
+	for (auto& j : next) total += j.count;
+	if (total >= LEARNAGE) {
+		for (auto& j : next) j.count = (j.count + 1) / 2;
+	}
+}
+
+// Loads counts saved by an earlier mount. Called once at startup.
+void prefetch_init() {
+	if (!config.learn) return;
+	// Without a cache path the counts would end up in the source path, and in its listings.
+	if (!config.cachepath) {
+		fprintf(stderr, "prefetch: -o learn needs -o cachepath, not learning.\n");
+		config.learn = 0;
+		return;
+	}
+	learnfile = string(config.cachepath) + "/.ddsfs-learned";
+
+	FILE* fp = fopen(learnfile.c_str(), "r");
+	if (!fp) return;
+	char line[8192];
+	int entries = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		// Each line is count, from and to, separated by tabs.
+		char* from = strchr(line, '\t');
+		if (!from) continue;
+		*from++ = 0;
+		char* to = strchr(from, '\t');
+		if (!to) continue;
+		*to++ = 0;
+		to[strcspn(to, "\r\n")] = 0;
+		unsigned int count = strtoul(line, NULL, 10);
+		if (count == 0 || !*from || !*to) continue;
+		learn_count(from, to, count);
+		entries++;
+	}
+	fclose(fp);
+	if (DEBUG) printf("prefetch: Loaded %d learned successors from '%s'.\n", entries, learnfile.c_str());
+}
+
+// Writes the counts out for the next mount. Called at unmount.
+void prefetch_save() {
+	if (!config.learn || learnfile.empty()) return;
+	string tmpfile = learnfile + ".tmp";
+
+	FILE* fp = fopen(tmpfile.c_str(), "w");
+	if (!fp) {
+		fprintf(stderr, "prefetch: Could not open '%s' for write.\n", tmpfile.c_str());
+		return;
+	}
+	pthread_mutex_lock(&learnlock);
+	for (auto& i : learned) {
+		for (auto& j : i.second) fprintf(fp, "%u\t%s\t%s\n", j.count, i.first.c_str(), j.path.c_str());
+	}
+	pthread_mutex_unlock(&learnlock);
+	if (fclose(fp) != 0 || rename(tmpfile.c_str(), learnfile.c_str()) == -1) {
+		fprintf(stderr, "prefetch: Could not save learned successors to '%s'.\n", learnfile.c_str());
+		unlink(tmpfile.c_str());
+	}
+}
+
+// Counts path as following the last open, then queues whichever textures
+// have followed it at least -o learnmin percent of the time.
+static void prefetch_learned(const char* path) {
+	if (!config.learn) return;
+
+	vector<Successor> queue;
+	pthread_mutex_lock(&learnlock);
+	if (!lastopen.empty() && lastopen != path) learn_count(lastopen, path, 1);
+	lastopen = path;
+
+	auto i = learned.find(path);
+	if (i != learned.end()) {
+		unsigned int total = 0;
+		for (auto& j : i->second) total += j.count;
+		for (auto& j : i->second) {
+			if (j.count >= 2 && j.count * 100 >= total * config.learnmin) queue.push_back(j);
+		}
+	}
+	pthread_mutex_unlock(&learnlock);
+	if (config.cache == CACHE_NONE) return;
+
+	std::sort(queue.begin(), queue.end(), [](const Successor& a, const Successor& b) { return a.count > b.count; });
+	for (auto& j : queue) {
+		if (!prefetch_one(j.path.c_str(), dds_size(4096, 4096))) return;
+	}
+}
+
+
+// Opens are handed over to a background thread, so an open never waits for
+// the stats and reads behind prefetching. It's kept apart from listings, so
+// opens aren't stuck behind a big directory.
+#define OPENQUEUE 256	// Opens waiting beyond this are dropped.
+
+struct Opened {
+	string path;
+	int ter;
+};
+
+static pthread_mutex_t openlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t openwork = PTHREAD_COND_INITIALIZER;
+static list<Opened> opens;
+static int openthread = 0;
+
+// Starts a worker the first time it's needed rather than at mount, so it
+// belongs to the daemon. Call with its lock held.
+static int prefetch_thread(int* started, void* (*run)(void*), const char* what) {
+	if (*started) return 1;
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, run, NULL) != 0) {
+		fprintf(stderr, "prefetch: Could not start %s thread.\n", what);
+		return 0;
+	}
+	pthread_detach(thread);
+	*started = 1;
+	return 1;
+}
+
+static void* prefetch_open_thread(void*) {
+	convert_thread_setup(1);
+
+	pthread_mutex_lock(&openlock);
+	while (1) {
+		while (opens.empty()) pthread_cond_wait(&openwork, &openlock);
+		Opened o = opens.front();
+		opens.pop_front();
+		pthread_mutex_unlock(&openlock);
+
+		if (o.ter) {
+			prefetch_terfile(o.path.c_str());
+		} else {
+			prefetch_learned(o.path.c_str());
+			prefetch_tiles(o.path.c_str());
+		}
+
+		pthread_mutex_lock(&openlock);
+	}
+	return NULL;
+}
+
+static void prefetch_queue(const char* path, int ter) {
+	pthread_mutex_lock(&openlock);
+	if (prefetch_thread(&openthread, prefetch_open_thread, "open") && opens.size() < OPENQUEUE) {
+		opens.push_back({path, ter});
+		pthread_cond_signal(&openwork);
+	} else if (DEBUG >= 2) {
+		printf("prefetch: Dropped '%s'.\n", path);
+	}
+	pthread_mutex_unlock(&openlock);
+}
+
+// Called after a converted file has been opened.
+void prefetch_opened(const char* path) {
+	if (!config.learn && (config.prefetch == 0 || config.cache == CACHE_NONE)) return;
+	prefetch_queue(path, 0);
+}
+
+// Called after a .ter file has been opened.
+void prefetch_ter(const char* path) {
+	if (!config.prefetchter || config.cache == CACHE_NONE) return;
+	prefetch_queue(path, 1);
+}
+
+
+// Directory listings handed over by readdir. They're worked through by one
+// background thread, so listing a directory never waits for any of it.
+static pthread_mutex_t listlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t listwork = PTHREAD_COND_INITIALIZER;
+static list<list<string>> listings;
+static int listthread = 0;
+
+static void prefetch_listing(list<string>& paths) {
+	unsigned int queued = 0;
+	for (auto& path : paths) {
+		string rwpath = config.basepath + path;
+		char srcpath[rwpath.size()+8];
+		int type = ddsfs_source(rwpath.c_str(), srcpath);
+		if (type == -1) continue;
+
+		// Header reads go first, so sizes for getattr are right whether or not it converts.
+		if (config.listprobe && sizecache_get(rwpath.c_str()) == -1) {
+			int res = ddsfs_probe(type, srcpath, rwpath.c_str());
+			if (res < 0 && DEBUG >= 2) printf("prefetch: Could not read header of '%s'.\n", srcpath);
+		}
+	}
+	if (!config.listconvert || config.cache == CACHE_NONE) return;
+	for (auto& path : paths) {
+		if (queued >= config.listconvert) break;
+		if (!prefetch_one(path.c_str(), dds_size(4096, 4096), CONVERT_IDLE)) break;
+		queued++;
+	}
+}
+
+static void* prefetch_list_thread(void*) {
+	convert_thread_setup(1);
+
+	pthread_mutex_lock(&listlock);
+	while (1) {
+		while (listings.empty()) pthread_cond_wait(&listwork, &listlock);
+		list<string> paths;
+		paths.swap(listings.front());
+		listings.pop_front();
+		pthread_mutex_unlock(&listlock);
+
+		prefetch_listing(paths);
+
+		pthread_mutex_lock(&listlock);
+	}
+	return NULL;
+}
+
+// Called by readdir with the converted files it listed. Takes the list.
+void prefetch_listed(list<string>& paths) {
+	pthread_mutex_lock(&listlock);
+	if (!prefetch_thread(&listthread, prefetch_list_thread, "listing")) {
+		pthread_mutex_unlock(&listlock);
+		return;
+	}
+	listings.emplace_back();
+	listings.back().swap(paths);
+	pthread_cond_signal(&listwork);
+	pthread_mutex_unlock(&listlock);
+}
@@ -1,48 +1,155 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
-#include <unordered_map>
+#include <pthread.h>
 #include "ddsfs.h"
 using namespace std;
 
 // Using int will fail with DDS files over 2 GB... but I think that's acceptable for now.
 // Not bothering to use any sort of expiry, since this will be able to store thousands of files per MB of RAM.
-static unordered_map<string,int> sizecache;
 
+// Names aren't kept, just a 64-bit hash to find the entry and a second,
+// unrelated 32-bit one to check it's the right name, so each entry is 16
+// bytes. The table is split into stripes with a lock each, so FUSE threads
+// looking up different files don't wait on each other.
+#define SIZESTRIPES 64
+#define SIZEMIN 256		// Slots in a stripe's first table. Always a power of two.
+
+struct SizeSlot {
+	uint64_t key;	// 0 for an empty slot.
+	uint32_t check;
+	int32_t size;
+};
+
+struct SizeStripe {
+	pthread_rwlock_t lock;
+	SizeSlot* slots;
+	uint32_t capacity;
+	uint32_t count;
+} __attribute__((aligned(64)));
+
+static SizeStripe sizecache[SIZESTRIPES];
+static pthread_once_t sizeonce = PTHREAD_ONCE_INIT;
+
+static void sizecache_init() {
+	for (int i = 0; i < SIZESTRIPES; i++) {
+		pthread_rwlock_init(&sizecache[i].lock, NULL);
+		sizecache[i].slots = NULL;
+		sizecache[i].capacity = 0;
+		sizecache[i].count = 0;
+	}
+}
+
+// FNV-1a for the key, and a multiply-shift hash with its own constants for the check.
+static void sizecache_hash(const char* name, uint64_t* key, uint32_t* check) {
+	size_t len = 0;
+	uint32_t c = 2166136261U;
+	for (const unsigned char* i = (const unsigned char*)name; *i; i++, len++) {
+		c = (c + *i) * 0x9E3779B1U;
+		c ^= c >> 15;
+	}
+	*key = fnv1a(name, len);
+	*check = c;
+}
+
+// Finds key's slot, or the empty one it would go in. Call with the stripe's lock held.
+static SizeSlot* sizecache_find(SizeSlot* slots, uint32_t capacity, uint64_t key) {
+	uint32_t mask = capacity - 1;
+	// The low bits picked the stripe, so the slot comes from the high ones.
+	for (uint32_t i = (key >> 32) & mask; ; i = (i + 1) & mask) {
+		if (slots[i].key == key || slots[i].key == 0) return &slots[i];
+	}
+}
+
+// Doubles a stripe's table. Call with its lock held for writing.
+static int sizecache_grow(SizeStripe* stripe) {
+	uint32_t capacity = stripe->capacity ? stripe->capacity * 2 : SIZEMIN;
+	SizeSlot* slots = (SizeSlot*)calloc(capacity, sizeof(SizeSlot));
+	if (!slots) return 0;
+	for (uint32_t i = 0; i < stripe->capacity; i++) {
+		if (stripe->slots[i].key) *sizecache_find(slots, capacity, stripe->slots[i].key) = stripe->slots[i];
+	}
+	free(stripe->slots);
+	stripe->slots = slots;
+	stripe->capacity = capacity;
+	return 1;
+}
+
+
+// Levels are halved, rounding down, until either side would go below MINSIZE.
+// Smaller images still get their first level.
+int dds_mips(int width, int height) {
+	int mips = 1;
+	while ((width >>= 1) >= MINSIZE && (height >>= 1) >= MINSIZE) mips++;
+	return mips;
+}
+
+// Bytes of DXT data for one level, counting partial blocks at the edges.
+int dds_dxtsize(int width, int height, int alpha) {
+	return ((width + 3) / 4) * ((height + 3) / 4) * (alpha == ALPHA_FULL ? 16 : 8);
+}
 
 int dds_size(int width, int height, int alpha) {
-	if (!poweroftwo(width) || !poweroftwo(height)) return width * height * 4;
-	
-	/*int pixels = 0;
-	int mips = 0;
-	// This really seems like it could be done with a single formula.
-	while ((height >> mips) >= MINSIZE && (width >> mips) >= MINSIZE) {
-		pixels += (height >> mips) * (width >> mips);
-		mips++;
-	}*/
+	int size = sizeof(DDS_HEADER);
+	int mips = dds_mips(width, height);
 	
-	// I *think* this works...
-	int pixels = (((height<<1)-1)-((MINSIZE<<1)-1)) * (((width<<1)-1)-((MINSIZE<<1)-1));
-	
-	if (config.compress) {
-		if (alpha) return sizeof(DDS_HEADER) + (pixels);
-		return sizeof(DDS_HEADER) + (pixels/2);
-	} else {
-		return sizeof(DDS_HEADER) + (pixels*4);
+	if (!config.compress) {
+		if (!poweroftwo(width) || !poweroftwo(height)) return size + width * height * 4;
+		for (int i = 0; i < mips; i++) size += (width >> i) * (height >> i) * 4;
+		return size;
 	}
+	
+	for (int i = 0; i < mips; i++) size += dds_dxtsize(width >> i, height >> i, alpha);
+	return size;
 }
 
 int sizecache_get(const char* name) {
-	auto i = sizecache.find(name);
-	if (i != sizecache.end()) {
-		if (DEBUG >= 3) printf("SizeCache: Found %d bytes for '%s'\n", i->second, name);
-		return i->second;
+	pthread_once(&sizeonce, sizecache_init);
+	uint64_t key;
+	uint32_t check;
+	sizecache_hash(name, &key, &check);
+	SizeStripe* stripe = &sizecache[key % SIZESTRIPES];
+	int size = -1;
+
+	pthread_rwlock_rdlock(&stripe->lock);
+	if (stripe->capacity) {
+		SizeSlot* slot = sizecache_find(stripe->slots, stripe->capacity, key);
+		if (slot->key == key && slot->check == check) size = slot->size;
+	}
+	pthread_rwlock_unlock(&stripe->lock);
+
+	if (DEBUG >= 3) {
+		if (size != -1) printf("SizeCache: Found %d bytes for '%s'\n", size, name);
+		else printf("SizeCache: No entry for '%s'\n", name);
 	}
-	if (DEBUG >= 3) printf("SizeCache: No entry for '%s'\n", name);
-	return -1;
+	return size;
 }
 
 void sizecache_set(const char* name, int size) {
 	if (DEBUG >= 3) printf("SizeCache: Set %d bytes for '%s'\n", size, name);
-	sizecache[name] = size;
-}
\ No newline at end of file
+	pthread_once(&sizeonce, sizecache_init);
+	uint64_t key;
+	uint32_t check;
+	sizecache_hash(name, &key, &check);
+	SizeStripe* stripe = &sizecache[key % SIZESTRIPES];
+
+	pthread_rwlock_wrlock(&stripe->lock);
+	// Kept under 3/4 full so probes stay short.
+	if ((stripe->count + 1) * 4 > stripe->capacity * 3 && !sizecache_grow(stripe)) {
+		pthread_rwlock_unlock(&stripe->lock);
+		return;
+	}
+	SizeSlot* slot = sizecache_find(stripe->slots, stripe->capacity, key);
+	if (slot->key == 0) stripe->count++;
+	// Another name with the same key just takes the slot over, the check stops it being mistaken for the old one.
+	slot->key = key;
+	slot->check = check;
+	slot->size = size;
+	pthread_rwlock_unlock(&stripe->lock);
+}
+// Forgets name's size. The slot is kept, since removing it could break the
+// chain of slots leading to others.
+void sizecache_forget(const char* name) {
+	if (sizecache_get(name) != -1) sizecache_set(name, -1);
+}
@@ -0,0 +1,225 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libdxt.h>
+#include "ddsfs.h"
+using namespace std;
+
+// What's been read from each source file's header, kept in a file mapped
+// into memory so the next mount has it too. It's an open-addressed table
+// keyed by a hash of the source path, and entries only count while the
+// source's size and modification time still match.
+
+#define INDEXMAGIC "DDSFSIX2"	// 1 recorded DXT1a files as DXT1.
+#define INDEXMIN 4096	// Slots in a new table. Always a power of two.
+
+struct IndexHeader {
+	char magic[8];
+	uint32_t capacity;
+	uint32_t count;
+};
+
+struct IndexSlot {
+	uint64_t key;	// 0 for an empty slot.
+	int64_t mtime;
+	int64_t srcsize;
+	int32_t width;
+	int32_t height;
+	int32_t size;
+	uint8_t alpha;
+	uint8_t format;	// FORMAT_DXT1, FORMAT_DXT1A or FORMAT_DXT5, or 0 for -o rgb and files that aren't images.
+	uint8_t pad[2];
+};
+
+static pthread_rwlock_t indexlock = PTHREAD_RWLOCK_INITIALIZER;
+static int indexfd = -1;
+static string indexfile;
+static IndexHeader* header = NULL;
+static IndexSlot* slots = NULL;
+
+static size_t index_bytes(uint32_t capacity) {
+	return sizeof(IndexHeader) + capacity * sizeof(IndexSlot);
+}
+
+static IndexHeader* index_map(int fd, uint32_t capacity) {
+	void* map = mmap(NULL, index_bytes(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return map == MAP_FAILED ? NULL : (IndexHeader*)map;
+}
+
+// Finds key's slot, or the empty one it would go in. Call with indexlock held.
+static IndexSlot* index_find(IndexSlot* table, uint32_t capacity, uint64_t key) {
+	uint32_t mask = capacity - 1;
+	for (uint32_t i = key & mask; ; i = (i + 1) & mask) {
+		if (table[i].key == key || table[i].key == 0) return &table[i];
+	}
+}
+
+// Makes a new, empty table file of the given size at path. Returns its descriptor or -1.
+static int index_create(const char* path, uint32_t capacity) {
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) return -1;
+	if (ftruncate(fd, index_bytes(capacity)) == -1) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	IndexHeader h;
+	memcpy(h.magic, INDEXMAGIC, sizeof(h.magic));
+	h.capacity = capacity;
+	h.count = 0;
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h)) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+	return fd;
+}
+
+// Doubles the table. It's built in a new file which replaces the old one, so a
+// crash part way through leaves the old one intact. Call with indexlock held for writing.
+static int index_grow() {
+	uint32_t capacity = header->capacity * 2;
+	string tmpfile = indexfile + ".tmp";
+	int fd = index_create(tmpfile.c_str(), capacity);
+	if (fd == -1) return 0;
+	IndexHeader* h = index_map(fd, capacity);
+	if (!h) {
+		close(fd);
+		unlink(tmpfile.c_str());
+		return 0;
+	}
+
+	IndexSlot* table = (IndexSlot*)(h + 1);
+	for (uint32_t i = 0; i < header->capacity; i++) {
+		if (slots[i].key == 0) continue;
+		*index_find(table, capacity, slots[i].key) = slots[i];
+		h->count++;
+	}
+	if (rename(tmpfile.c_str(), indexfile.c_str()) == -1) {
+		munmap(h, index_bytes(capacity));
+		close(fd);
+		unlink(tmpfile.c_str());
+		return 0;
+	}
+
+	munmap(header, index_bytes(header->capacity));
+	close(indexfd);
+	indexfd = fd;
+	header = h;
+	slots = table;
+	if (DEBUG) printf("srcindex: Grew to %u slots.\n", capacity);
+	return 1;
+}
+
+// Maps the index saved by an earlier mount, or starts a new one. Called once at startup.
+void srcindex_init() {
+	if (!config.index) return;
+	// Without a cache path it would end up in the source path, and in its listings.
+	if (!config.cachepath) {
+		fprintf(stderr, "srcindex: -o index needs -o cachepath, not indexing.\n");
+		config.index = 0;
+		return;
+	}
+	indexfile = string(config.cachepath) + "/.ddsfs-index";
+
+	int fd = open(indexfile.c_str(), O_RDWR);
+	if (fd != -1) {
+		struct stat st;
+		IndexHeader h;
+		if (fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, INDEXMAGIC, sizeof(h.magic))
+				&& h.capacity >= INDEXMIN && poweroftwo(h.capacity) && (size_t)st.st_size == index_bytes(h.capacity)) {
+			header = index_map(fd, h.capacity);
+		}
+		if (!header) {
+			fprintf(stderr, "srcindex: Starting again, '%s' is not a usable index.\n", indexfile.c_str());
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd == -1) {
+		fd = index_create(indexfile.c_str(), INDEXMIN);
+		if (fd != -1) header = index_map(fd, INDEXMIN);
+	}
+	if (!header) {
+		fprintf(stderr, "srcindex: Could not open '%s', headers won't be remembered.\n", indexfile.c_str());
+		if (fd != -1) close(fd);
+		return;
+	}
+	indexfd = fd;
+	slots = (IndexSlot*)(header + 1);
+	if (DEBUG) printf("srcindex: %u of %u slots used in '%s'.\n", header->count, header->capacity, indexfile.c_str());
+}
+
+// Looks up what was read from src's header last time. st is src's current
+// stat, so changed files are read again. Returns 0 if it was found.
+int srcindex_get(const char* src, const struct stat* st, SourceInfo* info) {
+	if (!header) return -1;
+	uint64_t key = fnv1a(src, strlen(src));
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&indexlock);
+	IndexSlot* slot = index_find(slots, header->capacity, key);
+	// Image sizes for -o rgb and -o dxt differ, so ones made for the other
+	// can't be used. Decompressed files have no width and are the same either way.
+	if (slot->key == key && slot->mtime == st->st_mtime && slot->srcsize == st->st_size
+			&& (slot->width == 0 || (slot->format != 0) == (config.compress != 0))) {
+		info->width = slot->width;
+		info->height = slot->height;
+		info->alpha = slot->alpha;
+		info->format = slot->format;
+		info->size = slot->size;
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&indexlock);
+	if (DEBUG >= 3) printf("srcindex: %s '%s'\n", ret ? "No entry for" : "Found", src);
+	return ret;
+}
+
+// Remembers what was read from src's header.
+void srcindex_set(const char* src, const struct stat* st, const SourceInfo* info) {
+	if (!header) return;
+	uint64_t key = fnv1a(src, strlen(src));
+
+	pthread_rwlock_wrlock(&indexlock);
+	IndexSlot* slot = index_find(slots, header->capacity, key);
+	if (slot->key == 0) {
+		// Kept under 3/4 full so probes stay short.
+		if ((header->count + 1) * 4 > header->capacity * 3 && index_grow()) slot = index_find(slots, header->capacity, key);
+		if (slot->key == 0 && (header->count + 1) * 4 > header->capacity * 3) {
+			pthread_rwlock_unlock(&indexlock);
+			return;
+		}
+		header->count++;
+	}
+	slot->mtime = st->st_mtime;
+	slot->srcsize = st->st_size;
+	slot->width = info->width;
+	slot->height = info->height;
+	slot->size = info->size;
+	slot->alpha = info->alpha;
+	slot->format = info->format;
+	slot->key = key;
+	pthread_rwlock_unlock(&indexlock);
+}
@@ -0,0 +1,222 @@
+/*
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <list>
+#include <unordered_set>
+#include "ddsfs.h"
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+using namespace std;
+
+// With -o watch, every directory under the source path is watched with
+// inotify. When a file changes, whatever ddsfs remembers about it and the
+// file converted from it is dropped, so the next lookup or open sees the new
+// one. With FUSE 3 the kernel is told too. FUSE 2's high-level API can't, so
+// there its own caching lasts as long as -o attr_timeout and -o entry_timeout.
+
+#ifdef __linux__
+#define WATCHEVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF)
+
+static int watchfd = -1;
+// Watch descriptors to the directory they're on, relative to the mount root.
+static unordered_map<int, string> watches;
+#endif
+
+// Files cache_write has made in the source path, so their events aren't
+// taken for changes to the source. A cache path elsewhere isn't watched.
+static pthread_mutex_t ourlock = PTHREAD_MUTEX_INITIALIZER;
+static unordered_set<string> ours;
+
+void watch_written(const char* file) {
+	if (!config.watch || strncmp(file, config.basepath, config.basepathlen) || file[config.basepathlen] != '/') return;
+	pthread_mutex_lock(&ourlock);
+	ours.insert(file);
+	pthread_mutex_unlock(&ourlock);
+}
+
+#ifdef __linux__
+
+static void watch_add(const string& path) {
+	string rwpath = config.basepath + path;
+	int wd = inotify_add_watch(watchfd, rwpath.empty() ? "/" : rwpath.c_str(), WATCHEVENTS | IN_ONLYDIR);
+	if (wd == -1) {
+		if (errno == ENOSPC) fprintf(stderr, "watch: Out of inotify watches at '%s', raise fs.inotify.max_user_watches.\n", rwpath.c_str());
+		return;
+	}
+	watches[wd] = path;
+}
+
+// Watches path and everything below it.
+static void watch_tree(const string& path) {
+	list<string> queue;
+	queue.push_back(path);
+	while (!queue.empty()) {
+		string dir = queue.front();
+		queue.pop_front();
+		watch_add(dir);
+
+		string rwpath = config.basepath + dir;
+		DIR* dp = opendir(rwpath.empty() ? "/" : rwpath.c_str());
+		if (!dp) continue;
+		struct dirent* de;
+		while ((de = readdir(dp))) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+			int isdir = de->d_type == DT_DIR;
+			if (de->d_type == DT_UNKNOWN) {
+				struct stat st;
+				isdir = lstat((rwpath + "/" + de->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+			}
+			if (isdir) queue.push_back(dir + "/" + de->d_name);
+		}
+		closedir(dp);
+	}
+}
+
+// Drops everything remembered about path, relative to the mount root.
+static void watch_forget(const string& path) {
+	string rwpath = config.basepath + path;
+	if (DEBUG >= 2) printf("watch: '%s' changed.\n", rwpath.c_str());
+	pthread_mutex_lock(&ourlock);
+	ours.erase(rwpath);
+	pthread_mutex_unlock(&ourlock);
+	sizecache_forget(rwpath.c_str());
+	memcache_forget(rwpath);
+	negcache_forget(rwpath.c_str());
+	#if USE_FUSE3
+	lowlevel_invalidate(path.c_str());
+	#endif
+	// Only files in cachepath are certainly ours to remove. Ones written next
+	// to the source can't be told apart from real .dds files.
+	if (config.cachepath) unlink((config.cachepath + path).c_str());
+}
+
+// Strips the .<n>.tmp cache_write adds to a name while writing it. Returns 0 if there isn't one.
+static int watch_tmpname(string& name) {
+	size_t len = name.size();
+	if (len < 6 || name.compare(len - 4, 4, ".tmp")) return 0;
+	size_t dot = name.rfind('.', len - 5);
+	if (dot == string::npos || dot == len - 5) return 0;
+	for (size_t i = dot + 1; i < len - 4; i++) {
+		if (!isdigit((unsigned char)name[i])) return 0;
+	}
+	name.resize(dot);
+	return 1;
+}
+
+// name in directory dir changed. Drops it, and the file converted from it if it's a source.
+static void watch_changed(const string& dir, const char* name, uint32_t mask) {
+	string path = dir + "/" + name;
+
+	// Writing a converted file and its .<n>.tmp is no reason to forget it. Once
+	// it's deleted or moved away, events for the name are someone else's again.
+	string rwpath = config.basepath + path;
+	int tmp = watch_tmpname(rwpath);
+	pthread_mutex_lock(&ourlock);
+	auto i = ours.find(rwpath);
+	int own = i != ours.end();
+	if (own && !tmp && (mask & (IN_DELETE | IN_MOVED_FROM))) ours.erase(i);
+	pthread_mutex_unlock(&ourlock);
+	if (own) return;
+
+	watch_forget(path);
+	dirindex_forget(dir.c_str());
+	#if USE_FUSE3
+	lowlevel_invalidate(dir.c_str());
+	#endif
+
+	const char* ext = strrchr(name, '.');
+	if (!ext) return;
+	size_t base = path.size() - strlen(ext);
+	#if USE_JPG
+	if (!strcasecmp(ext, ".jpg")) watch_forget(path.substr(0, base) + ".dds");
+	#endif
+	#if USE_WEBP
+	if (!strcasecmp(ext, ".webp")) watch_forget(path.substr(0, base) + ".dds");
+	#endif
+	#if USE_GZIP
+	if (!strcasecmp(ext, ".gz")) watch_forget(path.substr(0, base));
+	#endif
+	#if USE_XZ
+	if (!strcasecmp(ext, ".xz")) watch_forget(path.substr(0, base));
+	#endif
+}
+
+static void* watch_thread(void*) {
+	watch_tree("");
+	if (DEBUG) printf("watch: Watching %zu directories.\n", watches.size());
+
+	char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while (1) {
+		ssize_t len = read(watchfd, buf, sizeof(buf));
+		if (len <= 0) {
+			if (len == -1 && errno == EINTR) continue;
+			fprintf(stderr, "watch: Could not read events, no longer watching.\n");
+			break;
+		}
+		for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fprintf(stderr, "watch: Missed some changes, the inotify queue overflowed.\n");
+				continue;
+			}
+			auto i = watches.find(ev->wd);
+			if (i == watches.end()) continue;
+			if (ev->mask & IN_IGNORED) {
+				watches.erase(i);
+				continue;
+			}
+			if (!ev->len) continue;
+			// watch_tree can rehash watches, so this is a copy.
+			string dir = i->second;
+			watch_changed(dir, ev->name, ev->mask);
+			if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR)) watch_tree(dir + "/" + ev->name);
+		}
+	}
+	return NULL;
+}
+#endif
+
+// Starts watching the source path. Called from FUSE's init, so the thread belongs to the daemon.
+void watch_start() {
+	if (!config.watch) return;
+#ifdef __linux__
+	watchfd = inotify_init1(IN_CLOEXEC);
+	if (watchfd == -1) {
+		fprintf(stderr, "watch: Could not start inotify.\n");
+		return;
+	}
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+		fprintf(stderr, "watch: Could not start thread.\n");
+		close(watchfd);
+		watchfd = -1;
+		return;
+	}
+	pthread_detach(thread);
+#else
+	fprintf(stderr, "watch: Not supported on this system.\n");
+#endif
+}
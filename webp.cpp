@@ -16,10 +16,184 @@
 #include <stdlib.h>
 #include <sys/timeb.h>
 #include <errno.h>
+#include <algorithm>
+#include <emmintrin.h>
 #include <webp/decode.h>
 #include <libdxt.h>
 #include "ddsfs.h"
 
+// Bytes read from the file per step of the incremental decoder.
+#define WEBPCHUNK (256*1024)
+// Minimum rows encoded at once while the decode is still going.
+#define WEBPSTRIP 64
+
+
+// Scans rows of bytes for alpha values other than 255, and other than 0 and 255.
+// Bytes set in ignore, repeated every 4, aren't alpha and are skipped.
+static int alphaclass(const unsigned char* p, int bytes, int height, int pitch, unsigned int ignore) {
+	const __m128i ones = _mm_set1_epi8(-1), zero = _mm_setzero_si128();
+	const __m128i skip = _mm_set1_epi32(ignore);
+	__m128i all = ones, partial = zero;
+	
+	for (int y = 0; y < height; y++, p += pitch) {
+		int x = 0;
+		for (; x + 16 <= bytes; x += 16) {
+			__m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + x)), skip);
+			all = _mm_and_si128(all, a);
+			partial = _mm_or_si128(partial, _mm_andnot_si128(_mm_cmpeq_epi8(a, ones), _mm_xor_si128(_mm_cmpeq_epi8(a, zero), ones)));
+		}
+		for (; x < bytes; x++) {
+			unsigned char a = p[x] | (ignore >> ((x & 3) * 8));
+			if (a != 255 && a != 0) return ALPHA_FULL;
+			if (a != 255) all = zero;
+		}
+		// Most images with a gradient show it early, so don't scan the rest.
+		if (_mm_movemask_epi8(partial)) return ALPHA_FULL;
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(all, ones)) == 0xFFFF ? ALPHA_NONE : ALPHA_BINARY;
+}
+
+static unsigned int le32(const unsigned char* p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+// Lossy files keep their alpha in an ALPH chunk, which can be decoded on its own
+// for much less than the whole image. Returns -1 when there isn't one, as with
+// lossless files, which store it in the main image. It comes before the image,
+// so the start of the file is enough. Returns -2 until the chunk is all there.
+static int webp_alphaplane(const unsigned char* webp, size_t size, int width, int height) {
+	if (size < 12) return -2;
+	if (memcmp(webp, "RIFF", 4) || memcmp(webp + 8, "WEBP", 4)) return -1;
+	
+	const unsigned char* data = NULL;
+	size_t len = 0;
+	for (size_t pos = 12; ; ) {
+		if (pos + 8 > size) return -2;
+		size_t chunk = le32(webp + pos + 4);
+		if (!memcmp(webp + pos, "VP8 ", 4) || !memcmp(webp + pos, "VP8L", 4)) return -1;
+		if (pos + 8 + chunk > size) return -2;
+		if (!memcmp(webp + pos, "ALPH", 4) && chunk > 0) {
+			data = webp + pos + 9;
+			len = chunk - 1;
+			break;
+		}
+		pos += 8 + chunk + (chunk & 1);
+	}
+	
+	int method = data[-1] & 3, filter = (data[-1] >> 2) & 3;
+	if (method > 1 || (data[-1] >> 6)) return -1;
+	
+	unsigned char* plane = (unsigned char*)bufpool_get(width * height);
+	if (method == 0) {
+		if (len < (size_t)(width * height)) {
+			bufpool_put(plane);
+			return -1;
+		}
+		memcpy(plane, data, width * height);
+	} else {
+		// The compressed plane is a lossless image stream without its header, with the
+		// values in green. Give it one and let libwebp decode it.
+		size_t vp8l = 5 + len;
+		size_t riff = 12 + 8 + vp8l + (vp8l & 1);
+		unsigned char* wrapped = (unsigned char*)calloc(1, riff);
+		unsigned int bits = (width - 1) | (height - 1) << 14;
+		memcpy(wrapped, "RIFF", 4);
+		for (int i = 0; i < 4; i++) wrapped[4+i] = (riff - 8) >> (i*8);
+		memcpy(wrapped + 8, "WEBPVP8L", 8);
+		for (int i = 0; i < 4; i++) wrapped[16+i] = vp8l >> (i*8);
+		wrapped[20] = 0x2f;
+		for (int i = 0; i < 4; i++) wrapped[21+i] = bits >> (i*8);
+		memcpy(wrapped + 25, data, len);
+		
+		int w, h;
+		unsigned char* argb = WebPDecodeRGBA(wrapped, riff, &w, &h);
+		free(wrapped);
+		if (!argb || w != width || h != height) {
+			if (argb) WebPFree(argb);
+			bufpool_put(plane);
+			return -1;
+		}
+		for (int i = 0; i < width * height; i++) plane[i] = argb[i*4+1];
+		WebPFree(argb);
+	}
+	
+	// Undo the prediction filter, the same way libwebp does.
+	for (int y = 0; filter && y < height; y++) {
+		unsigned char* row = plane + y * width;
+		const unsigned char* prev = y ? row - width : NULL;
+		if (!prev || filter == 1) {
+			unsigned char pred = prev ? prev[0] : 0;
+			for (int x = 0; x < width; x++) pred = row[x] += pred;
+		} else if (filter == 2) {
+			for (int x = 0; x < width; x++) row[x] += prev[x];
+		} else {
+			unsigned char left = prev[0], topleft = prev[0];
+			for (int x = 0; x < width; x++) {
+				int g = left + prev[x] - topleft;
+				left = row[x] += (g < 0) ? 0 : (g > 255) ? 255 : g;
+				topleft = prev[x];
+			}
+		}
+	}
+	
+	int ret = alphaclass(plane, width, height, width, 0);
+	bufpool_put(plane);
+	return ret;
+}
+
+// Which of DXT1, DXT1 with 1-bit alpha or DXT5 the file needs, without decoding
+// the colour where that can be helped.
+static int webp_alphaclass(const unsigned char* webp, size_t size, const WebPBitstreamFeatures* wpbf) {
+	if (!wpbf->has_alpha) return ALPHA_NONE;
+	int ret = webp_alphaplane(webp, size, wpbf->width, wpbf->height);
+	if (ret >= 0) return ret;
+	
+	int width, height;
+	unsigned char* rgba = WebPDecodeRGBA(webp, size, &width, &height);
+	if (!rgba) return ALPHA_FULL;
+	ret = alphaclass(rgba, width * 4, height, width * 4, 0x00FFFFFF);
+	WebPFree(rgba);
+	return ret;
+}
+
+static const char* alpha_names[] = { "DXT1", "DXT1 with 1-bit alpha", "DXT5" };
+
+// Allocates the output for a DXT texture and writes its header.
+static int webp_dxt_header(int width, int height, int alpha, int* mips, unsigned char** dst) {
+	DDS_HEADER header;
+	memset(&header, 0, sizeof(header));
+	header.dwMagic = 0x20534444;
+	header.dwSize = 124;
+	header.dwFlags = 0x1 | 0x2 | 0x4 | 0x1000;
+	header.dwHeight = height;
+	header.dwWidth = width;
+	header.dwCaps = 0x1000;
+	
+	*mips = dds_mips(width, height);
+	int totalsize = sizeof(header);
+	for (int i = 0; i < *mips; i++) totalsize += dds_dxtsize(width >> i, height >> i, alpha);
+	
+	if (DEBUG) printf("DXT: Allocating %d bytes for %d mip%s of %s.\n", totalsize, *mips, *mips==1?"":"s", alpha_names[alpha]);
+	header.dwFlags |= 0x20000;
+	header.dwMipMapCount = *mips;
+	header.dwCaps |= 0x8 | 0x400000;
+	
+	DDS_PIXELFORMAT ddspix;
+	memset(&ddspix, 0, sizeof(ddspix));
+	ddspix.dwSize = 32;
+	ddspix.dwFlags = 0x4;
+	if (alpha == ALPHA_FULL) {
+		ddspix.dwFourCC = 'D' | 'X'<<8 | 'T'<<16 | '5'<<24;
+	} else {
+		ddspix.dwFourCC = 'D' | 'X'<<8 | 'T'<<16 | '1'<<24;
+		if (alpha == ALPHA_BINARY) ddspix.dwFlags |= 0x1;
+	}
+	header.ddspf = ddspix;
+
+	*dst = (unsigned char*)bufpool_get(totalsize);
+	memcpy(*dst, &header, sizeof(header));
+	return totalsize;
+}
 
 
 int ddsfs_webp_header(const char* src, int* width, int* height, int* alpha) {
@@ -30,22 +204,23 @@ int ddsfs_webp_header(const char* src, int* width, int* height, int* alpha) {
 	}
 	
 	size_t size = lseek(fd, 0, SEEK_END);
-	unsigned char* webp = (unsigned char*)memalign(16, size);
+	unsigned char* webp = (unsigned char*)bufpool_get(size);
 	lseek(fd, 0, SEEK_SET);
 	size = read(fd, webp, size);
 	close(fd);
 
 	WebPBitstreamFeatures wpbf;
 	VP8StatusCode rc = WebPGetFeatures(webp, size, &wpbf);
-	free(webp);
 	if (rc != VP8_STATUS_OK) {
 		fprintf(stderr, "WebP: Could not decode header for '%s': %d\n", src, rc);
+		bufpool_put(webp);
 		return -1;
 	}
 
 	*width = wpbf.width;
 	*height = wpbf.height;
-	*alpha = wpbf.has_alpha;
+	*alpha = config.compress ? webp_alphaclass(webp, size, &wpbf) : wpbf.has_alpha;
+	bufpool_put(webp);
 	return 0;
 }
 
@@ -63,120 +238,135 @@ int ddsfs_webp_dxt1(char* src, unsigned char** dst) {
 		return -1;
 	}
 	
+	// Only read enough to get the header to begin with. The rest is fed to the
+	// decoder as it comes in, so decoding overlaps the read.
 	size_t size = lseek(fd, 0, SEEK_END);
-	unsigned char* webp = (unsigned char*)memalign(16, size);
+	unsigned char* webp = (unsigned char*)bufpool_get(size);
 	lseek(fd, 0, SEEK_SET);
-	size = read(fd, webp, size);
-	close(fd);
-
+	size_t got = 0;
 
-	WebPBitstreamFeatures wpbf;
-	VP8StatusCode rc = WebPGetFeatures(webp, size, &wpbf);
+	WebPDecoderConfig wpconfig;
+	WebPInitDecoderConfig(&wpconfig);
+	WebPBitstreamFeatures& wpbf = wpconfig.input;
+	VP8StatusCode rc = VP8_STATUS_NOT_ENOUGH_DATA;
+	while (rc == VP8_STATUS_NOT_ENOUGH_DATA && got < size) {
+		ssize_t bytes = read(fd, webp + got, std::min(size - got, (size_t)WEBPCHUNK));
+		if (bytes <= 0) break;
+		got += bytes;
+		rc = WebPGetFeatures(webp, got, &wpbf);
+	}
 	if (rc != VP8_STATUS_OK) {
 		fprintf(stderr, "DXT: Could not decode header for '%s': %d\n", src, rc);
-		free(webp);
+		bufpool_put(webp);
+		close(fd);
 		return -1;
 	}
 	if (DEBUG >= 2) printf("DXT: Decoded %d x %d WebP %s alpha.\n", wpbf.width, wpbf.height, 
 							wpbf.has_alpha?"width":"without");
 
 	int width = wpbf.width, height = wpbf.height;
-	if (!poweroftwo(width) || !poweroftwo(height)) {
-		if (DEBUG) printf("DXT: Not a power-of-two texture, falling back to RGB.\n");
-		free(webp);
-		return ddsfs_webp_rgb(src, dst);
+	
+	// The ALPH chunk comes before the image, so only read on until it's all there.
+	int alpha = ALPHA_NONE;
+	if (wpbf.has_alpha) {
+		alpha = webp_alphaplane(webp, got, width, height);
+		while (alpha == -2 && got < size) {
+			ssize_t bytes = read(fd, webp + got, std::min(size - got, (size_t)WEBPCHUNK));
+			if (bytes <= 0) break;
+			got += bytes;
+			alpha = webp_alphaplane(webp, got, width, height);
+		}
+		if (alpha == -2) alpha = -1;
 	}
 	
-	unsigned char* rgba = (unsigned char*)memalign(16, width*height*4);
+	// Lossless files only know after the decode, so their header waits until then.
+	const int formats[] = { FORMAT_DXT1, FORMAT_DXT1A, FORMAT_DXT5 };
+	int mips = 0, totalsize = 0, owned = 0;
+	*dst = NULL;
+	unsigned char* dstpos = NULL;
+	if (alpha != -1) {
+		totalsize = webp_dxt_header(width, height, alpha, &mips, dst);
+		dstpos = *dst + sizeof(DDS_HEADER);
+		owned = convert_begin(*dst, totalsize, sizeof(DDS_HEADER));
+	}
+
+	// Decode straight into a padded buffer. Every WEBPSTRIP rows the decoder has
+	// finished are encoded while it carries on with the rest.
+	int pitch = PADDED(width) * 4;
+	unsigned char* rgba = (unsigned char*)bufpool_get(pitch * PADDED(height));
+	wpconfig.output.colorspace = MODE_RGBA;
+	wpconfig.output.is_external_memory = 1;
+	wpconfig.output.u.RGBA.rgba = rgba;
+	wpconfig.output.u.RGBA.stride = pitch;
+	wpconfig.output.u.RGBA.size = pitch * height;
+	wpconfig.options.use_threads = 1;
+
+	WebPIDecoder* idec = WebPIDecode(NULL, 0, &wpconfig);
+	int encoded = 0;
+	rc = idec ? WebPIUpdate(idec, webp, got) : VP8_STATUS_OUT_OF_MEMORY;
+	while (rc == VP8_STATUS_SUSPENDED) {
+		int last_y;
+		if (*dst && WebPIDecGetRGB(idec, &last_y, NULL, NULL, NULL) && (last_y & ~3) - encoded >= WEBPSTRIP) {
+			int rows = (last_y & ~3) - encoded;
+			padimage(rgba + encoded * pitch, width, rows);
+			dstpos += CompressDXT(rgba + encoded * pitch, dstpos, PADDED(width), rows, formats[alpha], config.threads);
+			encoded += rows;
+			convert_progress(dstpos - *dst);
+		}
 		
-	if (WebPDecodeRGBAInto(webp, size, rgba, width*height*4, width*4) == NULL) {
+		if (got == size) break;
+		ssize_t bytes = read(fd, webp + got, std::min(size - got, (size_t)WEBPCHUNK));
+		if (bytes <= 0) break;
+		got += bytes;
+		rc = WebPIUpdate(idec, webp, got);
+	}
+	close(fd);
+	if (idec) WebPIDelete(idec);
+	bufpool_put(webp);
+	if (rc != VP8_STATUS_OK) {
 		fprintf(stderr, "DXT: Could not decode image for '%s': %d\n", src, rc);
-		free(webp);
-		free(rgba);
-		return -1;		
+		bufpool_put(rgba);
+		if (!owned) bufpool_put(*dst);
+		*dst = NULL;
+		return -1;
+	}
+	if (alpha == -1) {
+		alpha = alphaclass(rgba, width * 4, height, pitch, 0x00FFFFFF);
+		totalsize = webp_dxt_header(width, height, alpha, &mips, dst);
+		dstpos = *dst + sizeof(DDS_HEADER);
+		convert_begin(*dst, totalsize, sizeof(DDS_HEADER));
 	}
 
 	if (DEBUG) {
 		ftime(&mid);
 		int diff = (1000.0 * (mid.time - start.time) + (mid.millitm - start.millitm));
-		printf("DXT: WebP decode done in %d ms.\n", diff);
-	}
-
-	DDS_HEADER header;
-	memset(&header, 0, sizeof(header));
-	header.dwMagic = 0x20534444;
-	header.dwSize = 124;
-	header.dwFlags = 0x1 | 0x2 | 0x4 | 0x1000;
-	header.dwHeight = height;
-	header.dwWidth = width;
-	header.dwCaps = 0x1000;
-	
-	int mips = 0;
-	int totalsize = sizeof(header);
-	if (wpbf.has_alpha) {
-		while ((height >> mips) >= MINSIZE && (width >> mips) >= MINSIZE) {
-			totalsize += (height >> mips) * (width >> mips);
-			mips++;
-		}
-	} else {
-		while ((height >> mips) >= MINSIZE && (width >> mips) >= MINSIZE) {
-			totalsize += (height >> mips) * (width >> mips) / 2;
-			mips++;
-		}
-	}
-	
-	if (DEBUG) printf("DXT: Allocating %d bytes for %d mip%s.\n", totalsize, mips, mips==1?"":"s");
-	header.dwFlags |= 0x20000;
-	header.dwMipMapCount = mips;
-	header.dwCaps |= 0x8 | 0x400000;
-	
-	DDS_PIXELFORMAT ddspix;
-	memset(&ddspix, 0, sizeof(ddspix));
-	ddspix.dwSize = 32;
-	ddspix.dwFlags = 0x4;
-	if (wpbf.has_alpha) {
-		ddspix.dwFourCC = 'D' | 'X'<<8 | 'T'<<16 | '5'<<24;
-	} else {
-		ddspix.dwFourCC = 'D' | 'X'<<8 | 'T'<<16 | '1'<<24;
+		printf("DXT: WebP decode done in %d ms, %d rows encoded during it.\n", diff, encoded);
 	}
-	header.ddspf = ddspix;
-
-	*dst = (unsigned char*)memalign(16, totalsize);
-	unsigned char* dstpos = *dst;
 
-	memcpy(dstpos, &header, sizeof(header));
-	dstpos += sizeof(header);
+	padimage(rgba + encoded * pitch, width, height - encoded);
+	dstpos += CompressDXT(rgba + encoded * pitch, dstpos, PADDED(width), PADDED(height) - encoded, formats[alpha], config.threads);
+	convert_progress(dstpos - *dst);
 
-	int bytes;
-	if (wpbf.has_alpha) {
-		CompressImageDXT5(rgba, dstpos, width, height, bytes);
-	} else {
-		CompressImageDXT1(rgba, dstpos, width, height, bytes);
+	// Level 0 was mostly encoded while it decoded, so it's halved on its own.
+	// Each level after that is halved into the next during its encode.
+	unsigned char* nextmip = NULL;
+	if (mips > 1) {
+		if (DEBUG >= 2) printf("DXT: Resample mip 1 (%d x %d)\n", width, height);
+		nextmip = (unsigned char*)bufpool_get(PADDED(width >> 1) * PADDED(height >> 1) * 4);
+		shrinkimage(rgba, width, height, nextmip);
 	}
-	dstpos += bytes;
-
-	int curmip = 0;
-	if (mips > 0) {
-		while (width > MINSIZE && height > MINSIZE) {
-			if (DEBUG >= 2) printf("DXT: Resample mip %d (%d x %d)\n", ++curmip, width, height);
-			unsigned char* nextmip = (unsigned char*)memalign(16, width * height * 4);
-			halveimage(rgba, width, height, nextmip);
-			width >>= 1;
-			height >>= 1;
-			free(rgba);
-			rgba = nextmip;
-			
-			if (DEBUG >= 2) printf("DXT: Compress mip %d (%d x %d)\n", curmip, width, height);
-			if (wpbf.has_alpha) {
-				CompressImageDXT5(rgba, dstpos, width, height, bytes);
-			} else {
-				CompressImageDXT1(rgba, dstpos, width, height, bytes);
-			}
-			dstpos += bytes;
-			if (DEBUG >= 2) printf("DXT: Done mip %d.\n", curmip);
-		}
+	for (int curmip = 1; curmip < mips; curmip++) {
+		width >>= 1;
+		height >>= 1;
+		std::swap(rgba, nextmip);
+		
+		if (DEBUG >= 2) printf("DXT: Compress mip %d (%d x %d)\n", curmip, width, height);
+		dstpos += convert_compress(rgba, dstpos, width, height, formats[alpha], curmip + 1 < mips ? nextmip : NULL, *dst);
+		convert_progress(dstpos - *dst);
+		if (DEBUG >= 2) printf("DXT: Done mip %d.\n", curmip);
 	}
-	free(rgba);
+	bufpool_put(rgba);
+	bufpool_put(nextmip);
 	
 	if (dstpos != *dst + totalsize) printf("Warning: Calculated size %d different from actual end offset %d!\n", totalsize, (int)(dstpos-*dst));
 
@@ -206,7 +396,7 @@ int ddsfs_webp_rgb(char* src, unsigned char** dst) {
 	}
 	
 	size_t size = lseek(fd, 0, SEEK_END);
-	unsigned char* webp = (unsigned char*)memalign(16, size);
+	unsigned char* webp = (unsigned char*)bufpool_get(size);
 	lseek(fd, 0, SEEK_SET);
 	size = read(fd, webp, size);
 	close(fd);
@@ -215,7 +405,7 @@ int ddsfs_webp_rgb(char* src, unsigned char** dst) {
 	VP8StatusCode rc = WebPGetFeatures(webp, size, &wpbf);
 	if (rc != VP8_STATUS_OK) {
 		fprintf(stderr, "RGB: Could not decode header for '%s': %d\n", src, rc);
-		free(webp);
+		bufpool_put(webp);
 		return -1;
 	}
 	if (DEBUG >= 2) printf("RGB: Decoded %d x %d WebP %s alpha.\n", wpbf.width, wpbf.height, 
@@ -236,10 +426,8 @@ int ddsfs_webp_rgb(char* src, unsigned char** dst) {
 	int mips = 0;
 	int totalsize = sizeof(header);
 	if (poweroftwo(width) && poweroftwo(height)) {
-		while ((height >> mips) >= MINSIZE && (width >> mips) >= MINSIZE) {
-			totalsize += (height >> mips) * (width >> mips) * 4;
-			mips++;
-		}
+		mips = dds_mips(width, height);
+		for (int i = 0; i < mips; i++) totalsize += (height >> i) * (width >> i) * 4;
 		if (DEBUG) printf("RGB: Allocating %d bytes for %d mip%s.\n", totalsize, mips, mips==1?"":"s");
 		header.dwFlags |= 0x20000;
 		header.dwMipMapCount = mips;
@@ -260,24 +448,35 @@ int ddsfs_webp_rgb(char* src, unsigned char** dst) {
 	if (wpbf.has_alpha) ddspix.dwABitMask = 0xFF000000;
 	header.ddspf = ddspix;
 	
-	*dst = (unsigned char*)memalign(16, totalsize+16);
+	*dst = (unsigned char*)bufpool_get(totalsize+16);
 	unsigned char* dstpos = *dst;
 
 	memcpy(dstpos, &header, sizeof(header));
 	dstpos += sizeof(header);
+	int owned = convert_begin(*dst, totalsize, sizeof(header));
 	
 	
 	// Decompress straight into the output buffer.
-	if (WebPDecodeBGRAInto(webp, size, dstpos, width*height*4, width*4) == NULL) {
-		fprintf(stderr, "RGB: Could not decode image for '%s'\n", src);
-		free(webp);
-		free(*dst);
+	WebPDecoderConfig wpconfig;
+	WebPInitDecoderConfig(&wpconfig);
+	wpconfig.output.colorspace = MODE_BGRA;
+	wpconfig.output.is_external_memory = 1;
+	wpconfig.output.u.RGBA.rgba = dstpos;
+	wpconfig.output.u.RGBA.stride = width*4;
+	wpconfig.output.u.RGBA.size = width*height*4;
+	wpconfig.options.use_threads = 1;
+	rc = WebPDecode(webp, size, &wpconfig);
+	if (rc != VP8_STATUS_OK) {
+		fprintf(stderr, "RGB: Could not decode image for '%s': %d\n", src, rc);
+		bufpool_put(webp);
+		if (!owned) bufpool_put(*dst);
 		(*dst) = 0;
 		return -1;
 	}
-	free(webp);
+	bufpool_put(webp);
 	int bytes = width * height * 4;
 	dstpos += bytes;
+	convert_progress(dstpos - *dst);
 	
 	if (DEBUG) {
 		ftime(&mid);
@@ -286,17 +485,15 @@ int ddsfs_webp_rgb(char* src, unsigned char** dst) {
 	}
 
 
-	if (mips > 0) {
-		int curmip = 0;
-		while (width > MINSIZE && height > MINSIZE) {
-			if (DEBUG >= 2) printf("RGB: Resample mip %d (%d x %d)\n", ++curmip, width, height);
-			halveimage(dstpos-bytes, width, height, dstpos);
-			width >>= 1;
-			height >>= 1;
-			bytes = width * height * 4;
-			dstpos += bytes;
-			if (DEBUG >= 2) printf("RGB: Done mip %d.\n", curmip);
-		}
+	for (int curmip = 1; curmip < mips; curmip++) {
+		if (DEBUG >= 2) printf("RGB: Resample mip %d (%d x %d)\n", curmip, width, height);
+		halveimage(dstpos-bytes, width, height, dstpos);
+		width >>= 1;
+		height >>= 1;
+		bytes = width * height * 4;
+		dstpos += bytes;
+		convert_progress(dstpos - *dst);
+		if (DEBUG >= 2) printf("RGB: Done mip %d.\n", curmip);
 	}
 	
 	if (DEBUG >= 2) printf("RGB: Wrote a total of %d bytes.\n", (int)(dstpos-(*dst)));
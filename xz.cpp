@@ -108,7 +108,7 @@ int ddsfs_xz(const char* src, unsigned char** dst) {
 	long len = lseek(fd, 0, SEEK_END);
 	lseek(fd, 0, SEEK_SET);
 	
-	uint8_t* data = (uint8_t*)malloc(len);
+	uint8_t* data = (uint8_t*)bufpool_get(len);
 	read(fd, data, len);
 	close(fd);
 	
@@ -116,7 +116,7 @@ int ddsfs_xz(const char* src, unsigned char** dst) {
 	XZHeader* header = (XZHeader*)data;
 	
 	if (memcmp(header->magic, XZ_MAGIC, 6)) {
-		free(data);
+		bufpool_put(data);
 		fprintf(stderr, "XZ: Bad ID in .xz file: %s\n", src);
 		return -1;
 	}
@@ -135,7 +135,7 @@ int ddsfs_xz(const char* src, unsigned char** dst) {
 	}
 	
 	
-	*dst = (unsigned char*)memalign(16, usize);
+	*dst = (unsigned char*)bufpool_get(usize);
 	
 	lzma_stream xz = LZMA_STREAM_INIT;
 	lzma_ret ret = lzma_stream_decoder(&xz, UINT64_MAX, 0);
@@ -147,18 +147,22 @@ int ddsfs_xz(const char* src, unsigned char** dst) {
 		ret = lzma_code(&xz, LZMA_FINISH);
 		if (ret == LZMA_OK) {
 			fprintf(stderr, "XZ: Allocated size %lu was insufficient, in .xz file: %s\n", usize, src);
+			unsigned char* bigger = (unsigned char*)bufpool_get(usize * 2);
+			memcpy(bigger, *dst, usize);
+			bufpool_put(*dst);
+			*dst = bigger;
+			xz.next_out = *dst + usize;
 			xz.avail_out += usize;
 			usize *= 2;
-			*dst = (unsigned char*)realloc(*dst, usize);
-			continue;
 		}
-	} while (false);
+	} while (ret == LZMA_OK);
 	
 	lzma_end(&xz);
+	bufpool_put(data);
 	
 	if (ret != LZMA_STREAM_END) {
 		fprintf(stderr, "XZ: Error %d decoding .xz file: %s\n", ret, src);
-		free(*dst);
+		bufpool_put(*dst);
 		*dst = NULL;
 		return -1;
 	} else {